@@ -5,7 +5,10 @@
 #include <linux/workqueue.h>
 #include "game.h"
 
-typedef int (*ai_alg)(unsigned int table, char player);
+/* @id is the game the move is searched for, letting engines keep per-game
+ * state between moves.
+ */
+typedef int (*ai_alg)(unsigned int table, char player, int id);
 
 struct ai_avg {
     s64 nsecs_o;
@@ -22,11 +25,16 @@ struct ai_game {
     struct work_struct ai_one_work;
     struct work_struct ai_two_work;
     struct work_struct drawboard_work;
+    struct work_struct release_work; /* frees what engines kept */
 };
 
+/* Workqueue running every AI move, shared with parallel searches */
+extern struct workqueue_struct *kxo_workqueue;
+
+/* RL values are signed, kept in fixed_point_t as two's complement */
 static inline fixed_point_t fixed_mul(fixed_point_t a, fixed_point_t b)
 {
-    return ((s64) a * b) >> FIXED_SCALE_BITS;
+    return ((s64) (s32) a * (s32) b) >> FIXED_SCALE_BITS;
 }
 
 static inline fixed_point_t fixed_mul_s32(fixed_point_t a, s32 b)
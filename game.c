@@ -1,10 +1,18 @@
-#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/string.h>
 
 #include "game.h"
+#include "util.h"
 
 static const int winpat_len = WIN_PATT_LEN(BOARD_SIZE, GOAL);
-static u32 win_patterns[WIN_PATT_LEN(BOARD_SIZE, GOAL)];
+u32 xo_win_patterns[WIN_PATT_LEN(BOARD_SIZE, GOAL)];
+u16 xo_win_cells[WIN_PATT_LEN(BOARD_SIZE, GOAL)];
 u8 xo_segment_lines[WIN_PATT_LEN(BOARD_SIZE, GOAL)][GOAL];
+u8 xo_cell_segments[N_GRIDS][XO_CELL_SEGMENTS];
+u8 xo_cell_nr_segments[N_GRIDS];
+int xo_segment_score[GOAL + 1][GOAL + 1];
+/* Bit m is set when the cells of the 16-bit mask m hold a whole segment */
+static DECLARE_BITMAP(win_map, 1 << N_GRIDS);
 
 const line_t lines[4] = {
     {0, 1, 0, 0, BOARD_SIZE, BOARD_SIZE - GOAL + 1},             // ROW
@@ -13,32 +21,29 @@ const line_t lines[4] = {
     {1, -1, 0, GOAL - 1, BOARD_SIZE - GOAL + 1, BOARD_SIZE},     // SECONDARY
 };
 
-static bool detect_empty_cell(uint32_t board)
-{
-    uint32_t lo = board & 0x55555555;
-    uint32_t hi = board & 0xAAAAAAAA;
-    return (lo | (hi >> 1)) != 0x55555555;
-}
-
 char check_win(unsigned int table)
 {
-    if (!table)
-        return CELL_EMPTY;
+    unsigned int cells = table_unzip(table);
+    unsigned int o = cells & 0xffff, x = cells >> 16;
 
+    if (test_bit(o, win_map))
+        return CELL_O;
+    if (test_bit(x, win_map))
+        return CELL_X;
+    return (o | x) == 0xffff ? CELL_D : CELL_EMPTY;
+}
 
-    for (int i = 0; i < winpat_len; i++) {
-        unsigned int patt = win_patterns[i];
-        /* check O is win */
-        if ((table & patt) == patt)
-            return CELL_O;
-
-        /* check X is win */
-        patt <<= 1;
-        if ((table & patt) == patt)
-            return CELL_X;
-    }
+/* check_win() of @table right after @move was played in it, on a position
+ * that had no winner yet: only the side of @move may have won.
+ */
+char check_win_move(unsigned int table, int move)
+{
+    unsigned int cells = table_unzip(table);
+    char player = TABLE_GET_CELL(table, move);
 
-    return detect_empty_cell(table) ? CELL_EMPTY : CELL_D;
+    if (test_bit((cells >> (player == CELL_X ? 16 : 0)) & 0xffff, win_map))
+        return player;
+    return ((cells | cells >> 16) & 0xffff) == 0xffff ? CELL_D : CELL_EMPTY;
 }
 
 void fill_win_patterns(void)
@@ -48,18 +53,56 @@ void fill_win_patterns(void)
         for (int i = line.i_lower_bound; i < line.i_upper_bound; ++i) {
             for (int j = line.j_lower_bound; j < line.j_upper_bound; ++j) {
                 xo_segment_lines[w][0] = GET_INDEX(i, j);
+                xo_win_cells[w] = 1u << GET_INDEX(i, j);
                 for (int k = 1; k < GOAL; k++) {
                     int id =
                         GET_INDEX(i + k * line.i_shift, j + k * line.j_shift);
                     xo_segment_lines[w][k] = id;
+                    xo_win_cells[w] |= 1u << id;
                 }
-                win_patterns[w] = GEN_O_WINMASK(xo_segment_lines[w][0],
-                                                xo_segment_lines[w][1],
-                                                xo_segment_lines[w][2]);
+                xo_win_patterns[w] = GEN_O_WINMASK(xo_segment_lines[w][0],
+                                                   xo_segment_lines[w][1],
+                                                   xo_segment_lines[w][2]);
                 w++;
             }
         }
     }
+
+    memset(xo_cell_nr_segments, 0, sizeof(xo_cell_nr_segments));
+    for (int w = 0; w < winpat_len; w++) {
+        for (int k = 0; k < GOAL; k++) {
+            int cell = xo_segment_lines[w][k];
+            xo_cell_segments[cell][xo_cell_nr_segments[cell]++] = w;
+        }
+    }
+
+    /* A mask wins once any mask it covers with one cell less does */
+    bitmap_zero(win_map, 1 << N_GRIDS);
+    for (int w = 0; w < winpat_len; w++)
+        __set_bit(xo_win_cells[w], win_map);
+    for (unsigned int m = 1; m < 1u << N_GRIDS; m++) {
+        for (unsigned int rest = m; rest; rest &= rest - 1) {
+            if (test_bit(m & ~(1u << __ffs(rest)), win_map)) {
+                __set_bit(m, win_map);
+                break;
+            }
+        }
+    }
+
+    /* A segment holding pieces of one side only is worth 10^(n - 1) to it
+     * for n pieces, any other segment nothing.
+     */
+    for (int o = 0; o <= GOAL; o++) {
+        for (int x = 0; x <= GOAL; x++) {
+            int score = 0;
+            if (!o != !x) {
+                score = 1;
+                for (int k = 1; k < o + x; k++)
+                    score *= 10;
+            }
+            xo_segment_score[o][x] = x ? -score : score;
+        }
+    }
 }
 
 fixed_point_t calculate_win_value(char win, unsigned char player)
@@ -70,14 +113,3 @@ fixed_point_t calculate_win_value(char win, unsigned char player)
         return 0U;
     return 1U << (FIXED_SCALE_BITS - 1);
 }
-
-int *available_moves(uint32_t table)
-{
-    int *moves = kzalloc(N_GRIDS * sizeof(int), GFP_KERNEL);
-    int m = 0;
-    for_each_empty_grid(i, table) moves[m++] = i;
-
-    if (m < N_GRIDS)
-        moves[m] = -1;
-    return moves;
-}
@@ -11,6 +11,7 @@
 #define GET_COL(x) ((x) % BOARD_SIZE)
 #define GET_ROW(x) ((x) / BOARD_SIZE)
 #define WIN_PATT_LEN(n, goal) (2 * (n - goal + 1) * (n + (n - goal + 1)))
+#define XO_CELL_SEGMENTS (4 * GOAL) /* bound of the segments through a cell */
 #define CELL_EMPTY 0u
 #define CELL_O 1u
 #define CELL_X 2u
@@ -18,10 +19,12 @@
 #define ATTR_MSK 0xfu
 #define XO_ATTR_ID(attr) (attr & ATTR_MSK)
 #define XO_ATTR_STEPS(attr) get_bits(attr, 0xf, 4)
-#define XO_ATTR_AI_ALG(attr) get_bits(attr, 0xf, 8)
+#define XO_ATTR_AI_ALG(attr) get_bits(attr, 0x3f, 8)
 #define XO_SET_ATTR_STEPS(attr, steps) set_bits(attr, steps, 0xf, 0x4)
 #define XO_SET_ATTR_AI_ALG(attr, ai1, ai2) \
-    set_bits(attr, (ai1) | (ai2) << 2, 0xf, 0x8)
+    set_bits(attr, (ai1) | (ai2) << 3, 0x3f, 0x8)
+#define XO_AI_ALG_O(alg) ((alg) & 7)
+#define XO_AI_ALG_X(alg) ((alg) >> 3)
 #define SET_RECORD_CELL(moves, step, n) set_bits64(moves, step, 0xful, n * 4u)
 #define GET_RECORD_CELL(moves, id) get_bits64(moves, 0xful, id * 4u)
 #define XO_IOCTL_MAGIC 0xbeaf
@@ -57,7 +60,9 @@ struct xo_avg {
 enum {
     XO_AI_MCTS,
     XO_AI_NEGAMAX,
-    XO_AI_RL,
+    XO_AI_MCTS_RL, /* rollouts alone until the RL tables are initialized */
+    XO_AI_PNS,     /* falls back to negamax when nothing is proven */
+    XO_AI_RL,      /* last, left out until RL is initialized */
     XO_AI_TOT,
 };
 
@@ -76,8 +81,8 @@ typedef unsigned fixed_point_t;
 
 extern const line_t lines[4];
 
-int *available_moves(unsigned int table);
 char check_win(unsigned int t);
+char check_win_move(unsigned int table, int move);
 fixed_point_t calculate_win_value(char win, unsigned char player);
 void fill_win_patterns(void);
 
@@ -18,6 +18,7 @@
 #include "ai_game.h"
 #include "mcts.h"
 #include "negamax.h"
+#include "pns.h"
 #include "reinforcement_learning.h"
 #include "util.h"
 
@@ -54,6 +55,8 @@ static struct xo_avg xo_avgs[N_GAMES];
 static ai_alg ai_algs[XO_AI_TOT] = {
     [XO_AI_MCTS] = mcts,
     [XO_AI_NEGAMAX] = negamax_predict,
+    [XO_AI_MCTS_RL] = mcts_rl,
+    [XO_AI_PNS] = pns_predict,
     [XO_AI_RL] = play_rl,
 };
 
@@ -88,6 +91,24 @@ static ssize_t kxo_state_store(struct device *dev,
 
 static DEVICE_ATTR_RW(kxo_state);
 
+static ssize_t kxo_mcts_stats_show(struct device *dev,
+                                   struct device_attribute *attr,
+                                   char *buf)
+{
+    return mcts_stats_show(buf);
+}
+
+static DEVICE_ATTR_RO(kxo_mcts_stats);
+
+static ssize_t kxo_negamax_stats_show(struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf)
+{
+    return negamax_stats_show(buf);
+}
+
+static DEVICE_ATTR_RO(kxo_negamax_stats);
+
 /* Data produced by the simulated device */
 
 /* Timer to simulate a periodic IRQ */
@@ -195,17 +216,20 @@ static void ai_one_work_func(struct work_struct *w)
     WARN_ON_ONCE(in_softirq());
     WARN_ON_ONCE(in_interrupt());
 
-    cpu = get_cpu();
+    /* For the log only, keeping preemption on: engines sleep on helpers */
+    cpu = raw_smp_processor_id();
     int id = XO_ATTR_ID(attr);
     int steps = XO_ATTR_STEPS(attr);
     pr_info("kxo: [CPU#%d] game-%d start doing %s\n", cpu, id, __func__);
     tv_start = ktime_get();
     mutex_lock(&game->lock);
-    int move;
-    int alg = (XO_ATTR_AI_ALG(attr) % (XO_AI_TOT - !rl_inited));
+    int move = xo_forced_move(table, CELL_O);
+    int alg = XO_AI_ALG_O(XO_ATTR_AI_ALG(attr)) % (XO_AI_TOT - !rl_inited);
     bool is_rl = alg == XO_AI_RL && rl_inited;
     pr_debug("[one]: id=%d, alg=%d, rl_init=%d\n", id, alg, rl_inited);
-    WRITE_ONCE(move, ai_algs[alg](table, CELL_O));
+    /* Search only when tactics leave the choice open */
+    if (move == -1)
+        WRITE_ONCE(move, ai_algs[alg](table, CELL_O, id));
     smp_mb();
 
     if (move != -1) {
@@ -237,7 +261,6 @@ static void ai_one_work_func(struct work_struct *w)
 
     pr_info("kxo: [CPU#%d] game-%d %s completed in %llu usec\n", cpu, id,
             __func__, (unsigned long long) nsecs >> 10);
-    put_cpu();
 }
 
 static void ai_two_work_func(struct work_struct *w)
@@ -253,17 +276,20 @@ static void ai_two_work_func(struct work_struct *w)
     WARN_ON_ONCE(in_softirq());
     WARN_ON_ONCE(in_interrupt());
 
-    cpu = get_cpu();
+    /* For the log only, keeping preemption on: engines sleep on helpers */
+    cpu = raw_smp_processor_id();
     int id = XO_ATTR_ID(attr);
     int steps = XO_ATTR_STEPS(attr);
     pr_info("kxo: [CPU#%d] game-%d start doing %s\n", cpu, id, __func__);
     tv_start = ktime_get();
     mutex_lock(&game->lock);
-    int move;
-    int alg = ((XO_ATTR_AI_ALG(attr) >> 2) % (XO_AI_TOT - !rl_inited));
+    int move = xo_forced_move(table, CELL_X);
+    int alg = XO_AI_ALG_X(XO_ATTR_AI_ALG(attr)) % (XO_AI_TOT - !rl_inited);
     bool is_rl = alg == XO_AI_RL && rl_inited;
     pr_debug("[two]: id=%d, alg=%d, rl_init=%d\n", id, alg, rl_inited);
-    WRITE_ONCE(move, ai_algs[alg](table, CELL_X));
+    /* Search only when tactics leave the choice open */
+    if (move == -1)
+        WRITE_ONCE(move, ai_algs[alg](table, CELL_X, id));
     smp_mb();
 
     if (move != -1) {
@@ -295,11 +321,22 @@ static void ai_two_work_func(struct work_struct *w)
 
     pr_info("kxo: [CPU#%d] game-%d %s completed in %llu usec\n", cpu, id,
             __func__, (unsigned long long) nsecs >> 10);
-    put_cpu();
+}
+
+/* Frees the search trees kept for a game that is over, in process context
+ * since the pool lock is not taken with interrupts off.
+ */
+static void release_work_func(struct work_struct *w)
+{
+    struct ai_game *game = container_of(w, struct ai_game, release_work);
+
+    mutex_lock(&game->lock);
+    mcts_release(XO_ATTR_ID(game->xo_tlb.attr));
+    mutex_unlock(&game->lock);
 }
 
 /* Workqueue for asynchronous bottom-half processing */
-static struct workqueue_struct *kxo_workqueue;
+struct workqueue_struct *kxo_workqueue;
 
 /* Tasklet handler.
  *
@@ -440,6 +477,7 @@ static void timer_handler(struct timer_list *__timer)
         else {
             int winner = win - 1;
             pr_info("kxo: game-%d %c win!!!\n", id, cell_tlb[winner]);
+            queue_work(kxo_workqueue, &game->release_work);
 
             read_lock(&attr_obj.lock);
             if (attr_obj.display == '1') {
@@ -630,6 +668,18 @@ static int __init kxo_init(void)
         goto error_device;
     }
 
+    ret = device_create_file(kxo_dev, &dev_attr_kxo_mcts_stats);
+    if (ret < 0) {
+        printk(KERN_ERR "failed to create sysfs file kxo_mcts_stats\n");
+        goto error_device;
+    }
+
+    ret = device_create_file(kxo_dev, &dev_attr_kxo_negamax_stats);
+    if (ret < 0) {
+        printk(KERN_ERR "failed to create sysfs file kxo_negamax_stats\n");
+        goto error_device;
+    }
+
     /* Allocate fast circular buffer */
     fast_buf.buf = vmalloc(PAGE_SIZE);
     if (!fast_buf.buf) {
@@ -670,6 +720,7 @@ static int __init kxo_init(void)
         INIT_WORK(&game->ai_one_work, ai_one_work_func);
         INIT_WORK(&game->ai_two_work, ai_two_work_func);
         INIT_WORK(&game->drawboard_work, drawboard_work_func);
+        INIT_WORK(&game->release_work, release_work_func);
     }
     memset(ai_avgs, 0, sizeof(ai_avgs));
 
@@ -711,6 +762,9 @@ static void __exit kxo_exit(void)
     tasklet_kill(&game_tasklet);
     flush_workqueue(kxo_workqueue);
     destroy_workqueue(kxo_workqueue);
+    mcts_exit();
+    negamax_exit();
+    pns_exit();
     vfree(fast_buf.buf);
     device_destroy(kxo_class, dev_id);
     class_destroy(kxo_class);
@@ -1,218 +1,1280 @@
+#include <linux/atomic.h>
+#include <linux/gfp.h>
+#include <linux/int_sqrt.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/limits.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/sysfs.h>
 
+#include "ai_game.h"
 #include "game.h"
 #include "mcts.h"
+#include "reinforcement_learning.h"
 #include "util.h"
+#include "zobrist.h"
 
-struct node {
-    int move;
+static int mcts_workers = 1; /* clamped to MCTS_MAX_WORKERS */
+module_param(mcts_workers, int, 0644);
+MODULE_PARM_DESC(mcts_workers, "MCTS workers searching each move");
+
+static bool mcts_shared_tree;
+module_param(mcts_shared_tree, bool, 0644);
+MODULE_PARM_DESC(mcts_shared_tree,
+                 "Let MCTS workers grow one shared tree instead of one each");
+
+static int mcts_budget_us; /* 0: bounded by ITERATIONS only */
+module_param(mcts_budget_us, int, 0644);
+MODULE_PARM_DESC(mcts_budget_us, "Wall-clock budget of one MCTS move in usecs");
+
+static bool mcts_transpositions;
+module_param(mcts_transpositions, bool, 0644);
+MODULE_PARM_DESC(mcts_transpositions,
+                 "Share MCTS nodes between move orders reaching one position");
+
+static bool mcts_batch_playouts;
+module_param(mcts_batch_playouts, bool, 0644);
+MODULE_PARM_DESC(mcts_batch_playouts,
+                 "Run 64 bit-sliced playouts per MCTS leaf instead of one");
+
+static bool mcts_rave;
+module_param(mcts_rave, bool, 0644);
+MODULE_PARM_DESC(mcts_rave, "Blend all-moves-as-first statistics into MCTS");
+
+/* Leaves are valued by rollouts alone until the table of the side is
+ * published. Past half, the heuristic the table starts from costs games
+ * against plain rollouts.
+ */
+static int mcts_rl_weight = 50;
+module_param(mcts_rl_weight, int, 0644);
+MODULE_PARM_DESC(mcts_rl_weight,
+                 "Percentage of the RL value in the leaf value of MCTS-RL, "
+                 "rollouts making up the rest");
+
+static int mcts_max_nodes; /* 0: bounded by memory only */
+module_param(mcts_max_nodes, int, 0644);
+MODULE_PARM_DESC(mcts_max_nodes, "Nodes all MCTS trees together may hold");
+
+static int mcts_search_nodes; /* 0: bounded by mcts_max_nodes only */
+module_param(mcts_search_nodes, int, 0644);
+MODULE_PARM_DESC(mcts_search_nodes,
+                 "Nodes one MCTS search may hold, the reused ones included");
+
+static bool mcts_early_stop = true;
+module_param(mcts_early_stop, bool, 0644);
+MODULE_PARM_DESC(mcts_early_stop,
+                 "Stop MCTS once the best root move can no longer change");
+
+/* Iterations between two checks of the budget */
+#define CHECK_INTERVAL 256
+
+/* Nodes an arena charges to mcts_max_nodes at once */
+#define MCTS_NODE_BATCH 256
+
+/* Playouts of one bit-sliced batch, one per bit of a u64 */
+#define MCTS_BATCH_LANES 64
+
+/* Visits charged to a node while a worker is below it, so that concurrent
+ * workers on a shared tree spread over different paths.
+ */
+#define VIRTUAL_LOSS 3
+#define NODE_EXPANDING (~0U)
+
+/* Nodes live in the chunks of the pool as a structure of arrays and refer to
+ * each other by 32-bit references: the chunk id above MCTS_CHUNK_NODE_BITS,
+ * the slot in the chunk below, and 0 for none. Chunks are sized in bytes,
+ * so that their slots fit in that field whatever the page size. The
+ * children of a node take consecutive slots of one chunk, so selection scans
+ * dense arrays.
+ *
+ * With transpositions on, a position reached by several move orders has one
+ * canonical node holding its statistics; the other slots created for it only
+ * link there. Nodes therefore carry their position instead of the move
+ * leading to them, and backpropagation follows the path recorded on the way
+ * down.
+ */
+#define MCTS_CHUNK_NODE_BITS 11
+#define MCTS_CHUNK_ORDER get_order(MCTS_CHUNK_SIZE)
+#define MCTS_CHUNK_HEAD_SIZE (sizeof(struct list_head) + 2 * sizeof(int))
+#define MCTS_NODE_SIZE                                           \
+    (2 * sizeof(atomic64_t) + 2 * sizeof(atomic_t) + 4 * sizeof(u32) + \
+     2 * sizeof(u8))
+#define MCTS_CHUNK_NODES \
+    ((MCTS_CHUNK_SIZE - MCTS_CHUNK_HEAD_SIZE) / MCTS_NODE_SIZE)
+
+/* Nodes are carved out of page chunks. A search owns the chunks it has
+ * touched and gives all of them back to the pool in one splice when it ends,
+ * so tearing down a tree costs O(1) instead of one kfree() per node.
+ */
+struct mcts_chunk {
+    struct list_head list;
+    unsigned int used;
+    unsigned int id; /* index in chunk_map[], kept until mcts_exit() */
+    atomic64_t score[MCTS_CHUNK_NODES]; /* sum of results, may exceed 32 bits */
+    atomic64_t amaf_score[MCTS_CHUNK_NODES]; /* RAVE statistics of the move */
+    atomic_t n_visits[MCTS_CHUNK_NODES];
+    atomic_t amaf_visits[MCTS_CHUNK_NODES];
+    uint32_t table[MCTS_CHUNK_NODES];
+    u32 first_child[MCTS_CHUNK_NODES]; /* 0, NODE_EXPANDING or a reference */
+    u32 link[MCTS_CHUNK_NODES]; /* canonical node, the slot itself if none */
+    u32 hnext[MCTS_CHUNK_NODES]; /* chain in the transposition index */
+    u8 player[MCTS_CHUNK_NODES]; /* side to move */
+    u8 n_children[MCTS_CHUNK_NODES]; /* published once the children are */
+};
+
+#define NODE(ref, field)                      \
+    (chunk_map[(ref) >> MCTS_CHUNK_NODE_BITS] \
+         ->field[(ref) & ((1U << MCTS_CHUNK_NODE_BITS) - 1)])
+
+/* An arena is used by one worker at a time, so it counts its work in plain
+ * fields and adds them to the context of its game once per search.
+ */
+struct mcts_arena {
+    struct list_head chunks; /* tail is the chunk being filled */
+    unsigned int nr_chunks;
+    unsigned int nr_nodes;
+    atomic_t *quota; /* nodes the search may still add, INT_MAX if unbounded */
+    unsigned int charged; /* nodes charged to mcts_max_nodes */
+    unsigned int credit;  /* charged nodes not allocated yet */
+    struct mcts_info *info;
+    unsigned int nr_expanded;
+    unsigned int nr_transposed;
+    unsigned int nr_refused;
+};
+
+/* Helper searching either an independent tree of its own (root parallelism)
+ * or the tree of the calling worker (tree parallelism).
+ */
+struct mcts_worker {
+    struct work_struct work;
+    struct mcts_arena arena;
+    u32 *own_index;
+    u32 *index; /* own_index, the shared tree's index or NULL */
+    struct state_array xoro_obj;
+    u32 root;
+    bool shared;
+    uint32_t table;
     char player;
-    int n_visits;
-    fixed_point_t score;
-    struct node *parent;
-    struct node *children[N_GRIDS];
+    int iterations;
+    ktime_t deadline;
+    bool rl;
+};
+
+/* Search tree kept by each side of each game between its moves */
+struct mcts_tree {
+    struct mcts_info info;
+    struct mcts_arena arena;
+    u32 *index; /* transposition index, allocated on first use */
+    u32 root;
+    atomic_t quota; /* shared by the arenas of one search */
+    struct mcts_worker helpers[MCTS_MAX_WORKERS - 1];
 };
 
-static struct mcts_info mcts_obj;
+static struct mcts_tree trees[N_GAMES][2];
+static struct mcts_chunk *chunk_map[MCTS_MAX_CHUNKS]; /* slot 0 unused */
+static unsigned int nr_chunk_ids;
+static LIST_HEAD(free_chunks);
+static DEFINE_SPINLOCK(pool_lock);
+static struct mcts_pool_stats pool_stats;
+static atomic_long_t nr_nodes; /* nodes charged to mcts_max_nodes */
 
-static struct node *new_node(int move, char player, struct node *parent)
+static struct mcts_chunk *get_chunk(void)
 {
-    struct node *node = kzalloc(sizeof(struct node), GFP_KERNEL);
-    node->move = move;
-    node->player = player;
-    node->n_visits = 0;
-    node->score = 0;
-    node->parent = parent;
-    memset(node->children, 0, sizeof(node->children));
-    return node;
+    struct mcts_chunk *chunk;
+    bool fresh = false;
+
+    spin_lock(&pool_lock);
+    chunk = list_first_entry_or_null(&free_chunks, struct mcts_chunk, list);
+    if (chunk)
+        list_del(&chunk->list);
+    spin_unlock(&pool_lock);
+
+    if (!chunk) {
+        chunk = (struct mcts_chunk *) __get_free_pages(GFP_KERNEL,
+                                                       MCTS_CHUNK_ORDER);
+        if (!chunk)
+            return NULL;
+        fresh = true;
+    }
+
+    spin_lock(&pool_lock);
+    if (fresh) {
+        if (nr_chunk_ids == MCTS_MAX_CHUNKS - 1) {
+            spin_unlock(&pool_lock);
+            free_pages((unsigned long) chunk, MCTS_CHUNK_ORDER);
+            return NULL;
+        }
+        chunk->id = ++nr_chunk_ids;
+        chunk_map[chunk->id] = chunk;
+        pool_stats.nr_chunks++;
+    }
+    if (++pool_stats.nr_busy_chunks > pool_stats.hwm_busy_chunks)
+        pool_stats.hwm_busy_chunks = pool_stats.nr_busy_chunks;
+    spin_unlock(&pool_lock);
+
+    chunk->used = 0;
+    return chunk;
 }
 
-static void free_node(struct node *node)
+static void arena_init(struct mcts_arena *arena)
 {
-    for (int i = 0; i < N_GRIDS; i++)
-        if (node->children[i])
-            free_node(node->children[i]);
-    kfree(node);
+    INIT_LIST_HEAD(&arena->chunks);
+    arena->nr_chunks = 0;
+    arena->nr_nodes = 0;
+    arena->quota = NULL;
+    arena->charged = 0;
+    arena->credit = 0;
+    arena->info = NULL;
+    arena->nr_expanded = 0;
+    arena->nr_transposed = 0;
+    arena->nr_refused = 0;
 }
 
-static fixed_point_t fixed_sqrt(fixed_point_t x)
+/* Add the counters of the arena to the context of its game */
+static void arena_flush_stats(struct mcts_arena *arena)
 {
-    if (!x || x == (1U << FIXED_SCALE_BITS))
-        return x;
+    struct mcts_info *info = arena->info;
 
-    fixed_point_t s = 0U;
-    for (int i = (31 - __builtin_clz(x | 1)); i >= 0; i--) {
-        fixed_point_t t = (1U << i);
-        if ((((s + t) * (s + t)) >> FIXED_SCALE_BITS) <= x)
-            s += t;
+    atomic64_add(arena->nr_expanded, &info->nr_expanded);
+    atomic64_add(arena->nr_transposed, &info->nr_transposed);
+    atomic64_add(arena->nr_refused, &info->nr_refused);
+    arena->nr_expanded = 0;
+    arena->nr_transposed = 0;
+    arena->nr_refused = 0;
+}
+
+/* Hand every chunk of the arena back to the pool at once */
+static void arena_release(struct mcts_arena *arena)
+{
+    spin_lock(&pool_lock);
+    list_splice_init(&arena->chunks, &free_chunks);
+    pool_stats.nr_busy_chunks -= arena->nr_chunks;
+    if (arena->nr_nodes > pool_stats.hwm_search_nodes)
+        pool_stats.hwm_search_nodes = arena->nr_nodes;
+    spin_unlock(&pool_lock);
+    atomic_long_sub(arena->charged, &nr_nodes);
+    arena->nr_chunks = 0;
+    arena->nr_nodes = 0;
+    arena->charged = 0;
+    arena->credit = 0;
+}
+
+/* Reserve @n consecutive slots of one chunk and return the first of them */
+static u32 arena_alloc(struct mcts_arena *arena, unsigned int n)
+{
+    struct mcts_chunk *chunk = NULL;
+
+    if (!list_empty(&arena->chunks))
+        chunk = list_last_entry(&arena->chunks, struct mcts_chunk, list);
+    if (!chunk || chunk->used + n > MCTS_CHUNK_NODES) {
+        chunk = get_chunk();
+        if (!chunk)
+            return 0;
+        list_add_tail(&chunk->list, &arena->chunks);
+        arena->nr_chunks++;
     }
-    return s;
+    arena->nr_nodes += n;
+    chunk->used += n;
+    return (chunk->id << MCTS_CHUNK_NODE_BITS) | (chunk->used - n);
 }
 
-static fixed_point_t fixed_log(fixed_point_t v)
+/* Charge mcts_max_nodes for at least @n more nodes of the arena. Nodes are
+ * charged MCTS_NODE_BATCH at a time, so that searches of different games
+ * touch the global count once per batch instead of on every expansion.
+ */
+static bool arena_charge(struct mcts_arena *arena, unsigned int n, bool force)
 {
-    if (!v || v == (1U << FIXED_SCALE_BITS))
-        return 0;
+    long max_nodes = READ_ONCE(mcts_max_nodes);
+    unsigned int batch = max_t(unsigned int, n, MCTS_NODE_BATCH);
 
-    fixed_point_t numerator = (v - (1U << FIXED_SCALE_BITS));
-    int neg = 0;
-    if (GET_SIGN(numerator)) {
-        neg = 1;
-        numerator = CLR_SIGN(numerator);
-        numerator = (1U << 31) - numerator;
+    for (;;) {
+        long total = atomic_long_add_return(batch, &nr_nodes);
+        if (force || max_nodes <= 0 || total <= max_nodes)
+            break;
+        atomic_long_sub(batch, &nr_nodes);
+        if (batch == n)
+            return false;
+        batch = n; /* what is left may still fit the run */
     }
+    arena->credit += batch;
+    arena->charged += batch;
+    return true;
+}
 
-    fixed_point_t y =
-        (numerator << FIXED_SCALE_BITS) / (v + (1U << FIXED_SCALE_BITS));
+/* Like arena_alloc(), for growing a tree: the run must also fit in the
+ * quota of the search and in mcts_max_nodes, unless it is @exempt, which
+ * only charges them. Roots and their children are exempt, so that a search
+ * always has a move to pick.
+ */
+static u32 arena_grow(struct mcts_arena *arena, unsigned int n, bool exempt)
+{
+    u32 ref = 0;
 
-    fixed_point_t ans = 0U;
-    for (unsigned i = 1; i < 20; i += 2) {
-        fixed_point_t z = (1U << FIXED_SCALE_BITS);
-        for (int j = 0; j < i; j++) {
-            z *= y;
-            z >>= FIXED_SCALE_BITS;
+    if (arena->quota && atomic_sub_return(n, arena->quota) < 0 && !exempt)
+        goto refund;
+    if (arena->credit < n && !arena_charge(arena, n, exempt))
+        goto refund;
+    ref = arena_alloc(arena, n);
+    if (ref) {
+        arena->credit -= n;
+        return ref;
+    }
+refund:
+    if (arena->quota)
+        atomic_add(n, arena->quota);
+    arena->nr_refused++;
+    return 0;
+}
+
+static void init_node(u32 ref, uint32_t table, char player, u32 link)
+{
+    NODE(ref, table) = table;
+    NODE(ref, player) = player;
+    NODE(ref, n_children) = 0;
+    NODE(ref, first_child) = 0;
+    atomic_set(&NODE(ref, n_visits), 0);
+    atomic64_set(&NODE(ref, score), 0);
+    atomic_set(&NODE(ref, amaf_visits), 0);
+    atomic64_set(&NODE(ref, amaf_score), 0);
+    NODE(ref, link) = link ? link : ref;
+    NODE(ref, hnext) = 0;
+}
+
+static u32 new_node(struct mcts_arena *arena, uint32_t table, char player)
+{
+    u32 ref = arena_grow(arena, 1, true);
+    if (ref)
+        init_node(ref, table, player, 0);
+    return ref;
+}
+
+static u32 *index_alloc(void)
+{
+    return kvcalloc(MCTS_INDEX_SIZE, sizeof(u32), GFP_KERNEL);
+}
+
+static void index_clear(u32 *index)
+{
+    if (index)
+        memset(index, 0, MCTS_INDEX_SIZE * sizeof(u32));
+}
+
+static u32 index_lookup(u32 *index, u64 hash, uint32_t table)
+{
+    u32 ref = smp_load_acquire(&index[hash & (MCTS_INDEX_SIZE - 1)]);
+    for (; ref; ref = NODE(ref, hnext))
+        if (NODE(ref, table) == table)
+            return ref;
+    return 0;
+}
+
+/* Lock-free push; two workers racing on one position merely leave a
+ * duplicate node that is never found.
+ */
+static void index_insert(u32 *index, u64 hash, u32 ref)
+{
+    u32 *head = &index[hash & (MCTS_INDEX_SIZE - 1)];
+    u32 first = READ_ONCE(*head);
+    do {
+        NODE(ref, hnext) = first;
+    } while (!try_cmpxchg(head, &first, ref));
+}
+
+/* The exploration term of UCT, c * sqrt(ln(N) / n) with c = sqrt(2), is split
+ * into c * sqrt(ln(N)), computed once per parent, and 1 / sqrt(n) per child.
+ * Both come from tables indexed by the visit count; counts past the tables
+ * are scaled down by a power of two first.
+ */
+#define UCT_TABLE_BITS 12
+#define UCT_TABLE_SIZE (1 << UCT_TABLE_BITS)
+#define LN2_FIXED 45426 /* ln(2) */
+#define INV_SQRT2_FIXED 46341 /* 1 / sqrt(2) */
+
+/* With RAVE, the mean of a node is blended with its all-moves-as-first mean
+ * by beta(n) = sqrt(k / (3n + k)), which leaves the AMAF mean in charge of
+ * rarely visited nodes and fades out as real visits accumulate.
+ */
+#define RAVE_EQUIV 500 /* k */
+
+static fixed_point_t ln_tbl[UCT_TABLE_SIZE];
+static fixed_point_t explore_tbl[UCT_TABLE_SIZE];
+static fixed_point_t inv_sqrt_tbl[UCT_TABLE_SIZE];
+static fixed_point_t rave_beta_tbl[UCT_TABLE_SIZE];
+
+/* log2(n) by repeated squaring of the mantissa, kept in Q30 */
+static fixed_point_t fixed_log2(u32 n)
+{
+    int k = ilog2(n);
+    u64 y = ((u64) n << 30) >> k;
+    fixed_point_t frac = 0;
+
+    for (int i = FIXED_SCALE_BITS - 1; i >= 0; i--) {
+        y = (y * y) >> 30;
+        if (y >= (2ULL << 30)) {
+            y >>= 1;
+            frac |= 1U << i;
         }
-        z <<= FIXED_SCALE_BITS;
-        z /= (i << FIXED_SCALE_BITS);
+    }
+    return ((fixed_point_t) k << FIXED_SCALE_BITS) + frac;
+}
 
-        ans += z;
+static void uct_init_tables(void)
+{
+    for (u32 n = 1; n < UCT_TABLE_SIZE; n++) {
+        ln_tbl[n] = ((u64) fixed_log2(n) * LN2_FIXED) >> FIXED_SCALE_BITS;
+        /* c^2 = 2 */
+        explore_tbl[n] = int_sqrt64((u64) ln_tbl[n] << (FIXED_SCALE_BITS + 1));
+        inv_sqrt_tbl[n] = int_sqrt64((1ULL << (2 * FIXED_SCALE_BITS)) / n);
     }
-    ans <<= 1;
-    ans = neg ? SET_SIGN(ans) : ans;
-    return ans;
+    for (u32 n = 0; n < UCT_TABLE_SIZE; n++)
+        rave_beta_tbl[n] = int_sqrt64(((u64) RAVE_EQUIV << 32) /
+                                      (3 * n + RAVE_EQUIV));
 }
 
-#define EXPLORATION_FACTOR fixed_sqrt(1U << (FIXED_SCALE_BITS + 1))
+static fixed_point_t uct_explore(u32 n_total)
+{
+    if (n_total < UCT_TABLE_SIZE)
+        return explore_tbl[n_total];
+
+    int shift = ilog2(n_total) - (UCT_TABLE_BITS - 1);
+    u64 ln = ln_tbl[n_total >> shift] + (u64) shift * LN2_FIXED;
+    return int_sqrt64(ln << (FIXED_SCALE_BITS + 1));
+}
+
+static fixed_point_t uct_inv_sqrt(u32 n)
+{
+    if (n < UCT_TABLE_SIZE)
+        return inv_sqrt_tbl[n];
 
-static inline fixed_point_t uct_score(int n_total,
+    int shift = ilog2(n) - (UCT_TABLE_BITS - 1);
+    fixed_point_t r = inv_sqrt_tbl[n >> shift] >> (shift >> 1);
+    if (shift & 1)
+        r = ((u64) r * INV_SQRT2_FIXED) >> FIXED_SCALE_BITS;
+    return r;
+}
+
+static fixed_point_t rave_beta(u32 n)
+{
+    if (n < UCT_TABLE_SIZE)
+        return rave_beta_tbl[n];
+    return int_sqrt64(((u64) RAVE_EQUIV << 32) / (3ULL * n + RAVE_EQUIV));
+}
+
+static inline fixed_point_t uct_score(fixed_point_t explore,
                                       int n_visits,
-                                      fixed_point_t score)
+                                      fixed_point_t mean)
+{
+    return mean +
+           (((u64) explore * uct_inv_sqrt(n_visits)) >> FIXED_SCALE_BITS);
+}
+
+static inline int nr_children(u32 ref)
+{
+    return smp_load_acquire(&NODE(ref, n_children));
+}
+
+/* Canonical node of the i-th child of @ref, whose children are published */
+static inline u32 child(u32 ref, int i)
+{
+    return NODE(NODE(ref, first_child) + i, link);
+}
+
+/* Mean result of a node visited @n_visits times, blended with its AMAF mean
+ * when @rave is set
+ */
+static fixed_point_t node_mean(u32 ref, int n_visits, bool rave)
 {
-    if (n_visits == 0)
-        return FIXED_MAX;
+    fixed_point_t mean = div_u64(atomic64_read(&NODE(ref, score)), n_visits);
+    int amaf_visits = rave ? atomic_read(&NODE(ref, amaf_visits)) : 0;
 
-    fixed_point_t result =
-        score << FIXED_SCALE_BITS /
-                     (fixed_point_t) (n_visits << FIXED_SCALE_BITS);
-    fixed_point_t tmp =
-        EXPLORATION_FACTOR *
-        fixed_sqrt(fixed_log(n_total << FIXED_SCALE_BITS) / n_visits);
-    tmp >>= FIXED_SCALE_BITS;
-    return result + tmp;
+    if (amaf_visits > 0) {
+        s64 amaf_mean =
+            div_u64(atomic64_read(&NODE(ref, amaf_score)), amaf_visits);
+        mean += ((amaf_mean - mean) * rave_beta(n_visits)) >> FIXED_SCALE_BITS;
+    }
+    return mean;
 }
 
-static struct node *select_move(struct node *node)
+/* The children are consecutive slots, so their links are read in one run.
+ * Unvisited children come first, in order.
+ */
+static u32 select_move(u32 ref, bool rave)
 {
-    struct node *best_node = NULL;
+    int n = nr_children(ref);
+    if (!n)
+        return 0;
+
+    const u32 *link = &NODE(NODE(ref, first_child), link);
+    u32 best = 0;
     fixed_point_t best_score = 0U;
-    for (int i = 0; i < N_GRIDS; i++) {
-        if (!node->children[i])
-            continue;
+    fixed_point_t explore =
+        uct_explore(max(atomic_read(&NODE(ref, n_visits)), 1));
+    for (int i = 0; i < n; i++) {
+        u32 c = link[i];
+        int n_visits = atomic_read(&NODE(c, n_visits));
+        if (n_visits <= 0) {
+            best = c;
+            break;
+        }
         fixed_point_t score =
-            uct_score(node->n_visits, node->children[i]->n_visits,
-                      node->children[i]->score);
+            uct_score(explore, n_visits, node_mean(c, n_visits, rave));
         if (score > best_score) {
             best_score = score;
-            best_node = node->children[i];
+            best = c;
         }
     }
-    return best_node;
+    return best;
 }
 
-static fixed_point_t simulate(uint32_t table, char player)
+/* Random playout on the packed table: empty cells are kept as a bitmask and
+ * the next move is the n-th set bit, so no move list is ever built.
+ */
+static fixed_point_t simulate(uint32_t table,
+                              char player,
+                              struct state_array *xoro_obj,
+                              uint32_t *end)
 {
     char current_player = player;
     uint32_t temp_table = table;
-    xoro_jump(&(mcts_obj.xoro_obj));
-    while (1) {
-        int *moves = available_moves(temp_table);
-        if (moves[0] == -1) {
-            kfree(moves);
-            break;
-        }
-        int n_moves = 0;
-        while (n_moves < N_GRIDS && moves[n_moves] != -1)
-            ++n_moves;
-        int move = moves[xoro_next(&(mcts_obj.xoro_obj)) % n_moves];
-        kfree(moves);
+    unsigned int empty = table_empty_mask(table);
+    while (empty) {
+        unsigned int n =
+            ((u64) (u32) xoro_next(xoro_obj) * hweight16(empty)) >> 32;
+        int move = mask_nth_cell(empty, n);
+        empty &= ~(1u << move);
         temp_table = VAL_SET_CELL(temp_table, move, current_player);
         char win;
-        if ((win = check_win(temp_table)) != CELL_EMPTY)
+        if ((win = check_win_move(temp_table, move)) != CELL_EMPTY) {
+            *end = temp_table;
             return calculate_win_value(win, player);
+        }
         current_player ^= CELL_O ^ CELL_X;
     }
+    *end = temp_table;
     return (fixed_point_t) (1UL << (FIXED_SCALE_BITS - 1));
 }
 
-static void backpropagate(struct node *node, fixed_point_t score)
+/* Draw a number below @e in every lane of @lanes into the bit planes @r,
+ * drawing again in the lanes that came out too large.
+ */
+static void batch_draw_below(u64 r[4],
+                             unsigned int e,
+                             u64 lanes,
+                             struct state_array *xoro_obj)
+{
+    int bits = fls(e - 1);
+
+    memset(r, 0, 4 * sizeof(u64));
+    while (lanes) {
+        for (int b = 0; b < bits; b++)
+            r[b] = (r[b] & ~lanes) | (xoro_next(xoro_obj) & lanes);
+        if (e == 1U << bits)
+            break;
+        /* r < e, comparing from the most significant plane down */
+        u64 lt = 0, eq = ~0ULL;
+        for (int b = bits - 1; b >= 0; b--) {
+            if (e & (1U << b)) {
+                lt |= eq & ~r[b];
+                eq &= r[b];
+            } else {
+                eq &= ~r[b];
+            }
+        }
+        lanes &= ~lt;
+    }
+}
+
+/* Lanes in which the pieces @own hold a winning line */
+static u64 batch_wins(const u64 own[N_GRIDS])
+{
+    u64 wins = 0;
+    for (int i = 0; i < WIN_PATT_LEN(BOARD_SIZE, GOAL); i++) {
+        u64 line = ~0ULL;
+        for (int j = 0; j < GOAL; j++)
+            line &= own[xo_segment_lines[i][j]];
+        wins |= line;
+    }
+    return wins;
+}
+
+/* MCTS_BATCH_LANES random playouts from one position, bit-sliced: bit l of
+ * cells[side][i] is set when lane l has a piece of that side in cell i. All
+ * lanes fill one cell per ply, so they share the count of empty cells and
+ * the side to move; each lane picks the r-th empty cell by counting r down
+ * over the cells in parallel. Returns the mean result for @player.
+ */
+static fixed_point_t simulate_batch(uint32_t table,
+                                    char player,
+                                    struct state_array *xoro_obj)
+{
+    u64 cells[2][N_GRIDS];
+    unsigned int empty = table_empty_mask(table);
+    u64 active = ~0ULL, won = 0;
+    char side = player;
+
+    for (int i = 0; i < N_GRIDS; i++) {
+        unsigned int cell = TABLE_GET_CELL(table, i);
+        cells[0][i] = cell == CELL_O ? ~0ULL : 0;
+        cells[1][i] = cell == CELL_X ? ~0ULL : 0;
+    }
+    for (unsigned int e = hweight16(empty); e && active; e--) {
+        u64 *own = cells[side == CELL_X];
+        u64 pending = active;
+        u64 r[4];
+
+        batch_draw_below(r, e, active, xoro_obj);
+        for (unsigned int m = empty; m && pending; m &= m - 1) {
+            int i = __ffs(m);
+            u64 free = ~(cells[0][i] | cells[1][i]) & pending;
+            u64 hit = free & ~(r[0] | r[1] | r[2] | r[3]);
+            own[i] |= hit;
+            pending &= ~hit;
+            /* count down in the lanes passing over a free cell */
+            u64 borrow = free & ~hit;
+            for (int b = 0; b < 4 && borrow; b++) {
+                u64 t = r[b];
+                r[b] ^= borrow;
+                borrow &= ~t;
+            }
+        }
+
+        u64 wins = batch_wins(own) & active;
+        if (side == player)
+            won |= wins;
+        active &= ~wins;
+        side ^= CELL_O ^ CELL_X;
+    }
+    /* lanes still active at the end are draws */
+    return ((u64) (2 * hweight64(won) + hweight64(active))
+            << (FIXED_SCALE_BITS - 1)) /
+           MCTS_BATCH_LANES;
+}
+
+/* Every node below the root was charged VIRTUAL_LOSS visits on the way down;
+ * turn that into the single real visit. @score is the result for the player
+ * who moved into path[depth], and each node keeps the result for the player
+ * who moved into it.
+ */
+static void backpropagate(u32 *path, int depth, fixed_point_t score)
 {
-    while (node) {
-        node->n_visits++;
-        node->score += score;
-        node = node->parent;
-        score = 1 - score;
+    for (int i = depth; i >= 0; i--) {
+        atomic_add(i ? 1 - VIRTUAL_LOSS : 1, &NODE(path[i], n_visits));
+        atomic64_add(score, &NODE(path[i], score));
+        score = RL_FIXED_1 - score;
     }
 }
 
-static int expand(struct node *node, uint32_t table)
+/* All moves as first: credit the children of every node on the path with
+ * the moves its side to move went on to play anywhere below it, in the tree
+ * or in the rollout that left the board at @end. @score is the result for
+ * the player who moved into path[depth].
+ */
+static void rave_update(u32 *path, int depth, uint32_t end, fixed_point_t score)
+{
+    fixed_point_t value = RL_FIXED_1 - score; /* for the side to move */
+
+    for (int i = depth; i >= 0; i--, value = RL_FIXED_1 - value) {
+        int n = nr_children(path[i]);
+        if (!n)
+            continue;
+
+        uint32_t table = NODE(path[i], table);
+        char player = NODE(path[i], player);
+        unsigned int played = table_player_mask(end, player) &
+                              ~table_player_mask(table, player);
+        unsigned int empty = table_empty_mask(table);
+        const u32 *link = &NODE(NODE(path[i], first_child), link);
+        for (int k = 0; k < n && played; k++, empty &= empty - 1) {
+            unsigned int move = 1U << __ffs(empty);
+            if (!(played & move))
+                continue;
+            played &= ~move;
+            atomic_inc(&NODE(link[k], amaf_visits));
+            atomic64_add(value, &NODE(link[k], amaf_score));
+        }
+    }
+}
+
+static void revert_virtual_loss(u32 *path, int depth)
+{
+    for (int i = depth; i > 0; i--)
+        atomic_sub(VIRTUAL_LOSS, &NODE(path[i], n_visits));
+}
+
+/* Only the worker that claims the node fills its children; the others keep
+ * going without waiting and see the children once n_children is published.
+ * Given an @index, children already reached through another move order are
+ * linked instead of allocated again.
+ */
+static int expand(struct mcts_arena *arena, u32 *index, u32 ref, bool root)
 {
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-    for (int i = 0; i < n_moves; i++) {
-        node->children[i] =
-            new_node(moves[i], node->player ^ CELL_O ^ CELL_X, node);
+    if (cmpxchg(&NODE(ref, first_child), 0, NODE_EXPANDING) != 0)
+        return 0;
+
+    uint32_t table = NODE(ref, table);
+    char player = NODE(ref, player);
+    unsigned int empty = table_empty_mask(table);
+    int n_moves = hweight16(empty);
+    u32 first = n_moves ? arena_grow(arena, n_moves, root) : 0;
+    if (!first)
+        return 0;
+
+    u64 hash = index ? zobrist_hash(table) : 0;
+    int n = 0;
+    int transposed = 0;
+    for_each_move(move, empty) {
+        uint32_t child_table = VAL_SET_CELL(table, move, player);
+        u64 child_hash = hash ^ zobrist_table[move][player == CELL_X];
+        u32 link = index ? index_lookup(index, child_hash, child_table) : 0;
+        init_node(first + n, child_table, player ^ CELL_O ^ CELL_X, link);
+        if (link)
+            transposed++;
+        else if (index)
+            index_insert(index, child_hash, first + n);
+        n++;
     }
-    kfree(moves);
+    arena->nr_expanded += n_moves - transposed;
+    arena->nr_transposed += transposed;
+    WRITE_ONCE(NODE(ref, first_child), first);
+    smp_store_release(&NODE(ref, n_children), n_moves);
     return n_moves;
 }
 
-int mcts(uint32_t table, char player)
+/* Copy the node, subtree or sub-DAG when @index is given, at @src into the
+ * slot @dst. Nodes visited fewer than @min_visits times, or whose children
+ * find no room left in the pool, are copied as leaves. The copy replaces a
+ * larger tree, so it is exempt from the budgets.
+ */
+static void clone_subtree(struct mcts_arena *arena,
+                          u32 *index,
+                          u32 dst,
+                          u32 src,
+                          int min_visits)
 {
+    src = NODE(src, link);
+    init_node(dst, NODE(src, table), NODE(src, player), 0);
+    atomic_set(&NODE(dst, n_visits), atomic_read(&NODE(src, n_visits)));
+    atomic64_set(&NODE(dst, score), atomic64_read(&NODE(src, score)));
+    atomic_set(&NODE(dst, amaf_visits), atomic_read(&NODE(src, amaf_visits)));
+    atomic64_set(&NODE(dst, amaf_score),
+                 atomic64_read(&NODE(src, amaf_score)));
+    if (index)
+        index_insert(index, zobrist_hash(NODE(dst, table)), dst);
+
+    int n = nr_children(src);
+    if (!n || atomic_read(&NODE(src, n_visits)) < min_visits)
+        return;
+    u32 first = arena_grow(arena, n, true);
+    if (!first)
+        return;
+    for (int i = 0; i < n; i++) {
+        u32 c = child(src, i);
+        uint32_t table = NODE(c, table);
+        u32 link = index ? index_lookup(index, zobrist_hash(table), table) : 0;
+        if (link)
+            init_node(first + i, table, NODE(c, player), link);
+        else
+            clone_subtree(arena, index, first + i, c, min_visits);
+    }
+    NODE(dst, first_child) = first;
+    NODE(dst, n_children) = n;
+}
+
+/* Nodes clone_subtree() copies from @ref with @min_visits, or some count
+ * past @limit once it is clear they do not fit
+ */
+static unsigned int reuse_count(u32 ref, int min_visits, unsigned int limit)
+{
+    ref = NODE(ref, link);
+    int n = nr_children(ref);
+    if (!n || atomic_read(&NODE(ref, n_visits)) < min_visits)
+        return 1;
+
+    unsigned int count = 1 + n;
+    for (int i = 0; i < n && count <= limit; i++)
+        count += reuse_count(child(ref, i), min_visits, limit) - 1;
+    return count;
+}
+
+/* Lowest power of two of visits a node needs to keep its children in the
+ * reused tree for that to stay within @limit nodes. The least visited
+ * leaves are recycled first.
+ */
+static int reuse_threshold(u32 ref, unsigned int limit)
+{
+    int min_visits = 0;
+
+    while (reuse_count(ref, min_visits, limit) > limit)
+        min_visits = min_visits ? min_visits * 2 : 1;
+    return min_visits;
+}
+
+/* Append the chunks of @src to @dst, leaving @src empty */
+static void arena_move(struct mcts_arena *dst, struct mcts_arena *src)
+{
+    list_splice_tail_init(&src->chunks, &dst->chunks);
+    dst->nr_chunks += src->nr_chunks;
+    dst->nr_nodes += src->nr_nodes;
+    dst->charged += src->charged;
+    dst->credit += src->credit;
+    src->nr_chunks = 0;
+    src->nr_nodes = 0;
+    src->charged = 0;
+    src->credit = 0;
+}
+
+static u32 find_grandchild(const struct mcts_tree *tree, uint32_t table)
+{
+    u32 old = tree->root;
+
+    for (int i = 0; old && i < nr_children(old); i++) {
+        u32 c = child(old, i);
+        for (int j = 0; j < nr_children(c); j++) {
+            if (NODE(child(c, j), table) == table)
+                return child(c, j);
+        }
+    }
+    return 0;
+}
+
+/* Keep only the subtree at @src of the tree, copied into a fresh arena and
+ * pruned to @limit nodes when that is not 0; the rest of the old tree goes
+ * back to the pool at once. Returns the new root, 0 when nothing is kept.
+ */
+static u32 keep_subtree(struct mcts_tree *tree,
+                        u32 *index,
+                        u32 src,
+                        unsigned int limit)
+{
+    u32 root = 0;
+    struct mcts_arena arena;
+
+    arena_init(&arena);
+    arena.quota = &tree->quota;
+    arena.info = &tree->info;
+    index_clear(tree->index);
+    if (src) {
+        int min_visits = limit ? reuse_threshold(src, limit) : 0;
+        root = arena_grow(&arena, 1, true);
+        if (root)
+            clone_subtree(&arena, index, root, src, min_visits);
+    }
+    arena_flush_stats(&arena);
+    arena_release(&tree->arena);
+    arena_move(&tree->arena, &arena);
+    tree->root = root;
+    return root;
+}
+
+/* Re-root the tree of the previous move at the grandchild reached by our
+ * last move and the opponent's reply, reusing at most @reuse_limit nodes of
+ * it when that is not 0.
+ */
+static u32 reroot(struct mcts_tree *tree,
+                  u32 *index,
+                  uint32_t table,
+                  char player,
+                  unsigned int reuse_limit)
+{
+    u32 root = keep_subtree(tree, index, find_grandchild(tree, table),
+                            reuse_limit);
+
+    if (!root)
+        root = new_node(&tree->arena, table, player);
+    tree->root = root;
+    return root;
+}
+
+/* The search is over once @deadline has passed, or once the most visited
+ * child of the root is further ahead of the runner-up than the iterations
+ * still left in the budget, so that no more work can change the move.
+ */
+static bool search_decided(u32 root,
+                           int iterations,
+                           ktime_t deadline,
+                           ktime_t start,
+                           int start_visits)
+{
+    int n_visits = atomic_read(&NODE(root, n_visits));
+    s64 left = iterations - n_visits;
+
+    if (deadline) {
+        ktime_t now = ktime_get();
+        if (!ktime_before(now, deadline))
+            return true;
+        /* iterations the whole tree can still take at the rate so far */
+        s64 elapsed = ktime_to_ns(ktime_sub(now, start)) + 1;
+        s64 rate_left = div64_s64((s64) (n_visits - start_visits) *
+                                      ktime_to_ns(ktime_sub(deadline, now)),
+                                  elapsed);
+        left = min(left, rate_left);
+    }
+    if (!READ_ONCE(mcts_early_stop))
+        return false;
+
+    int first = 0, second = 0;
+    for (int i = 0; i < nr_children(root); i++) {
+        int v = atomic_read(&NODE(child(root, i), n_visits));
+        if (v > first) {
+            second = first;
+            first = v;
+        } else if (v > second) {
+            second = v;
+        }
+    }
+    return first - second > left;
+}
+
+/* Grow the tree under @root until it has been visited @iterations times or
+ * search_decided() says more work is useless. Several workers may run this
+ * on the same root, each with its own arena.
+ */
+static void search(struct mcts_arena *arena,
+                   u32 *index,
+                   struct state_array *xoro_obj,
+                   u32 root,
+                   int iterations,
+                   ktime_t deadline,
+                   bool rl)
+{
+    u32 path[N_GRIDS + 1];
     char win;
-    struct node *root = new_node(-1, player, NULL);
-    mcts_obj.nr_active_nodes = 1;
-    for (int i = 0; i < ITERATIONS; i++) {
-        struct node *node = root;
-        uint32_t temp_table = table;
+    s64 rollouts = 0, rl_evals = 0;
+    ktime_t start = ktime_get();
+    int start_visits = atomic_read(&NODE(root, n_visits));
+    bool batch = READ_ONCE(mcts_batch_playouts);
+    bool rave = READ_ONCE(mcts_rave);
+    int rl_weight = rl ? clamp(READ_ONCE(mcts_rl_weight), 0, 100) : 0;
+    for (int i = 1; atomic_read(&NODE(root, n_visits)) < iterations; i++) {
+        if (!(i % CHECK_INTERVAL) &&
+            search_decided(root, iterations, deadline, start, start_visits))
+            break;
+        u32 node = root;
+        int depth = 0;
+        bool unvisited = atomic_read(&NODE(root, n_visits)) == 0;
+        path[0] = root;
         while (1) {
-            if ((win = check_win(temp_table)) != CELL_EMPTY) {
-                fixed_point_t score =
-                    calculate_win_value(win, node->player ^ CELL_O ^ CELL_X);
-                backpropagate(node, score);
-                break;
+            uint32_t table = NODE(node, table), end = table;
+            char player = NODE(node, player);
+            fixed_point_t score;
+            if ((win = check_win(table)) != CELL_EMPTY) {
+                score = calculate_win_value(win, player ^ CELL_O ^ CELL_X);
+            } else if (unvisited ||
+                       (!nr_children(node) &&
+                        !expand(arena, index, node, !depth))) {
+                /* Value a leaf, or a node expanded by another worker right
+                 * now, by the RL table, rollouts or a blend of both.
+                 * Playouts score the position for its side to move; a batch
+                 * counts as one visit with its mean result and leaves @end
+                 * at the leaf.
+                 */
+                fixed_point_t value = FIXED_MAX;
+                if (rl_weight)
+                    value = rl_after_state_value(table,
+                                                 player ^ CELL_O ^ CELL_X);
+                if (value != FIXED_MAX && rl_weight == 100) {
+                    score = value;
+                } else {
+                    score = RL_FIXED_1 -
+                            (batch ? simulate_batch(table, player, xoro_obj)
+                                   : simulate(table, player, xoro_obj, &end));
+                    rollouts += batch ? MCTS_BATCH_LANES : 1;
+                    if (value != FIXED_MAX)
+                        score = (value * rl_weight +
+                                 score * (100 - rl_weight)) / 100;
+                }
+                rl_evals += value != FIXED_MAX;
+            } else {
+                node = select_move(node, rave);
+                if (!node) {
+                    revert_virtual_loss(path, depth);
+                    goto out;
+                }
+                path[++depth] = node;
+                unvisited =
+                    atomic_fetch_add(VIRTUAL_LOSS, &NODE(node, n_visits)) == 0;
+                continue;
             }
-            if (node->n_visits == 0) {
-                fixed_point_t score = simulate(temp_table, node->player);
-                backpropagate(node, score);
-                break;
-            }
-            if (node->children[0] == NULL)
-                mcts_obj.nr_active_nodes += expand(node, temp_table);
-            node = select_move(node);
-            if (!node)
-                return -1;
-            temp_table = VAL_SET_CELL(temp_table, node->move,
-                                      node->player ^ CELL_O ^ CELL_X);
+            backpropagate(path, depth, score);
+            if (rave)
+                rave_update(path, depth, end, score);
+            break;
         }
     }
-    struct node *best_node = root;
-    int most_visits = -1;
+out:
+    atomic64_add(rollouts, &arena->info->nr_rollouts);
+    atomic64_add(rl_evals, &arena->info->nr_rl_evals);
+    atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+                 &arena->info->search_ns);
+    arena_flush_stats(arena);
+}
+
+static void mcts_worker_func(struct work_struct *work)
+{
+    struct mcts_worker *worker = container_of(work, struct mcts_worker, work);
+
+    if (!worker->shared)
+        worker->root = new_node(&worker->arena, worker->table, worker->player);
+    if (worker->root)
+        search(&worker->arena, worker->index, &worker->xoro_obj, worker->root,
+               worker->iterations, worker->deadline, worker->rl);
+}
+
+static void merge_visits(u32 root, int visits[N_GRIDS])
+{
+    unsigned int empty = table_empty_mask(NODE(root, table));
+    for (int i = 0; i < nr_children(root); i++) {
+        u32 c = child(root, i);
+        int move = __ffs(empty & ~table_empty_mask(NODE(c, table)));
+        visits[move] += atomic_read(&NODE(c, n_visits));
+    }
+}
+
+/* A move drawn among the empty cells of @table, for when the budgets left
+ * no tree to pick from: any legal move beats skipping the turn.
+ */
+static int random_move(uint32_t table, struct state_array *xoro_obj)
+{
+    unsigned int empty = table_empty_mask(table);
+
+    if (!empty)
+        return -1;
+    unsigned int n = ((u64) (u32) xoro_next(xoro_obj) * hweight16(empty)) >> 32;
+    return mask_nth_cell(empty, n);
+}
+
+/* With @rl set, leaves are valued from the RL state-value table as well */
+static int mcts_move(uint32_t table, char player, int id, bool rl)
+{
+    struct mcts_tree *tree = &trees[id][player == CELL_X];
+    int n_workers = clamp(READ_ONCE(mcts_workers), 1, MCTS_MAX_WORKERS);
+    bool shared = READ_ONCE(mcts_shared_tree);
+    int iterations = shared ? ITERATIONS : ITERATIONS / n_workers;
+    int budget_us = READ_ONCE(mcts_budget_us);
+    ktime_t deadline = budget_us > 0 ? ktime_add_us(ktime_get(), budget_us) : 0;
+    bool transpositions = READ_ONCE(mcts_transpositions);
+    int search_nodes = READ_ONCE(mcts_search_nodes);
+    int max_nodes = READ_ONCE(mcts_max_nodes);
+    int visits[N_GRIDS] = {0};
+    struct mcts_info *info = &tree->info;
+    struct state_array xoro_obj;
+
+    /* Waits for the helpers, so never from atomic context */
+    might_sleep();
+    if (transpositions && !tree->index)
+        tree->index = index_alloc();
+    u32 *index = transpositions ? tree->index : NULL;
+    /* Half of a bounded search is left for new nodes */
+    atomic_set(&tree->quota, search_nodes > 0 ? search_nodes : INT_MAX);
+    u32 root = reroot(tree, index, table, player,
+                      search_nodes > 0 ? search_nodes / 2 : 0);
+    if (!root)
+        return random_move(table, &info->xoro_obj);
+
+    /* Every worker draws its rollouts from a distinct jump of the stream */
+    for (int i = 1; i < n_workers; i++) {
+        struct mcts_worker *worker = &tree->helpers[i - 1];
+        xoro_jump(&info->xoro_obj);
+        worker->xoro_obj = info->xoro_obj;
+        if (transpositions && !shared && !worker->own_index)
+            worker->own_index = index_alloc();
+        worker->index = !transpositions ? NULL
+                        : shared        ? index
+                                        : worker->own_index;
+        worker->root = shared ? root : 0;
+        worker->shared = shared;
+        worker->table = table;
+        worker->player = player;
+        worker->iterations = iterations;
+        worker->deadline = deadline;
+        worker->rl = rl;
+        queue_work(kxo_workqueue, &worker->work);
+    }
+    xoro_jump(&info->xoro_obj);
+    xoro_obj = info->xoro_obj;
+
+    search(&tree->arena, index, &xoro_obj, root, iterations, deadline, rl);
+
+    for (int i = 1; i < n_workers; i++) {
+        struct mcts_worker *worker = &tree->helpers[i - 1];
+        flush_work(&worker->work);
+        /* Nodes of a shared tree stay with it for the next move */
+        if (shared)
+            arena_move(&tree->arena, &worker->arena);
+        else if (worker->root)
+            merge_visits(worker->root, visits);
+        index_clear(worker->own_index);
+        arena_release(&worker->arena);
+    }
+    merge_visits(root, visits);
+    /* Idle until our next move, the tree must leave mcts_max_nodes to the
+     * searches of the other games: all kept trees together hold at most
+     * half of it.
+     */
+    if (max_nodes > 0)
+        keep_subtree(tree, index, root, max(max_nodes / (4 * N_GAMES), 1));
+    WRITE_ONCE(info->nr_active_nodes, tree->arena.nr_nodes);
+
+    int best_move = -1, most_visits = 0;
     for (int i = 0; i < N_GRIDS; i++) {
-        if (root->children[i] && root->children[i]->n_visits > most_visits) {
-            most_visits = root->children[i]->n_visits;
-            best_node = root->children[i];
+        if (visits[i] > most_visits) {
+            most_visits = visits[i];
+            best_move = i;
         }
     }
-    int best_move = best_node->move;
-    free_node(root);
-    return best_move;
+    return best_move != -1 ? best_move : random_move(table, &xoro_obj);
+}
+
+int mcts(uint32_t table, char player, int id)
+{
+    return mcts_move(table, player, id, false);
+}
+
+int mcts_rl(uint32_t table, char player, int id)
+{
+    return mcts_move(table, player, id, true);
+}
+
+static void mcts_info_init(struct mcts_info *info,
+                           const struct state_array *xoro_obj)
+{
+    info->xoro_obj = *xoro_obj;
+    info->nr_active_nodes = 0;
+    atomic64_set(&info->nr_rollouts, 0);
+    atomic64_set(&info->nr_rl_evals, 0);
+    atomic64_set(&info->search_ns, 0);
+    atomic64_set(&info->nr_expanded, 0);
+    atomic64_set(&info->nr_transposed, 0);
+    atomic64_set(&info->nr_refused, 0);
 }
 
 void mcts_init(void)
 {
-    xoro_init(&(mcts_obj.xoro_obj));
-    mcts_obj.nr_active_nodes = 0;
+    struct state_array xoro_obj;
+
+    BUILD_BUG_ON(sizeof(struct mcts_chunk) > MCTS_CHUNK_SIZE);
+    BUILD_BUG_ON(MCTS_CHUNK_NODES > 1U << MCTS_CHUNK_NODE_BITS);
+    uct_init_tables();
+    xoro_init(&xoro_obj);
+    for (int i = 0; i < N_GAMES; i++) {
+        for (int j = 0; j < 2; j++) {
+            struct mcts_tree *tree = &trees[i][j];
+            /* Each tree gets a stream of its own, which its workers split
+             * further by plain jumps.
+             */
+            mcts_info_init(&tree->info, &xoro_obj);
+            xoro_long_jump(&xoro_obj);
+            arena_init(&tree->arena);
+            tree->arena.quota = &tree->quota;
+            tree->arena.info = &tree->info;
+            tree->index = NULL;
+            tree->root = 0;
+            for (int k = 0; k < MCTS_MAX_WORKERS - 1; k++) {
+                INIT_WORK(&tree->helpers[k].work, mcts_worker_func);
+                arena_init(&tree->helpers[k].arena);
+                tree->helpers[k].arena.quota = &tree->quota;
+                tree->helpers[k].arena.info = &tree->info;
+                tree->helpers[k].own_index = NULL;
+            }
+        }
+    }
+}
+
+/* Trees are only reused within a game, and the engines of the next one are
+ * drawn anew, so give those of game @id back to the pool once it is over.
+ * No move of the game may be searched meanwhile.
+ */
+void mcts_release(int id)
+{
+    for (int j = 0; j < 2; j++) {
+        struct mcts_tree *tree = &trees[id][j];
+        index_clear(tree->index);
+        arena_release(&tree->arena);
+        tree->root = 0;
+        WRITE_ONCE(tree->info.nr_active_nodes, 0);
+    }
+}
+
+void mcts_exit(void)
+{
+    struct mcts_chunk *chunk, *tmp;
+
+    for (int i = 0; i < N_GAMES; i++) {
+        mcts_release(i);
+        for (int j = 0; j < 2; j++) {
+            struct mcts_tree *tree = &trees[i][j];
+            kvfree(tree->index);
+            tree->index = NULL;
+            for (int k = 0; k < MCTS_MAX_WORKERS - 1; k++) {
+                kvfree(tree->helpers[k].own_index);
+                tree->helpers[k].own_index = NULL;
+            }
+        }
+    }
+
+    spin_lock(&pool_lock);
+    list_for_each_entry_safe(chunk, tmp, &free_chunks, list) {
+        list_del(&chunk->list);
+        chunk_map[chunk->id] = NULL;
+        free_pages((unsigned long) chunk, MCTS_CHUNK_ORDER);
+        pool_stats.nr_chunks--;
+    }
+    nr_chunk_ids = 0;
+    spin_unlock(&pool_lock);
+}
+
+ssize_t mcts_stats_show(char *buf)
+{
+    struct mcts_pool_stats stats;
+    u64 rollouts = 0, rl_evals = 0, ns = 0, expanded = 0, transposed = 0;
+    u64 refused = 0;
+
+    for (int i = 0; i < N_GAMES; i++) {
+        for (int j = 0; j < 2; j++) {
+            struct mcts_info *info = &trees[i][j].info;
+            rollouts += atomic64_read(&info->nr_rollouts);
+            rl_evals += atomic64_read(&info->nr_rl_evals);
+            ns += atomic64_read(&info->search_ns);
+            expanded += atomic64_read(&info->nr_expanded);
+            transposed += atomic64_read(&info->nr_transposed);
+            refused += atomic64_read(&info->nr_refused);
+        }
+    }
+    u64 usecs = div_u64(ns, NSEC_PER_USEC);
+
+    spin_lock(&pool_lock);
+    stats = pool_stats;
+    spin_unlock(&pool_lock);
+
+    return sysfs_emit(buf,
+                      "node_size %zu\n"
+                      "chunk_nodes %zu\n"
+                      "chunks %lu\n"
+                      "busy_chunks %lu\n"
+                      "hwm_busy_chunks %lu\n"
+                      "hwm_search_nodes %lu\n"
+                      "rollouts %llu\n"
+                      "rollouts_per_sec %llu\n"
+                      "rl_evals %llu\n"
+                      "expanded_nodes %llu\n"
+                      "transposed_nodes %llu\n"
+                      "nodes %ld\n"
+                      "max_nodes %d\n"
+                      "search_nodes %d\n"
+                      "refused_runs %llu\n",
+                      MCTS_NODE_SIZE, (size_t) MCTS_CHUNK_NODES,
+                      stats.nr_chunks,
+                      stats.nr_busy_chunks, stats.hwm_busy_chunks,
+                      stats.hwm_search_nodes, rollouts,
+                      usecs ? div64_u64(rollouts * USEC_PER_SEC, usecs) : 0,
+                      rl_evals, expanded, transposed,
+                      atomic_long_read(&nr_nodes),
+                      READ_ONCE(mcts_max_nodes), READ_ONCE(mcts_search_nodes),
+                      refused);
 }
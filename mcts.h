@@ -1,14 +1,42 @@
 #pragma once
 
+#include <linux/atomic.h>
+#include <linux/sizes.h>
+#include <linux/types.h>
 #include "xoroshiro.h"
 
 #define ITERATIONS 100000
+#define MCTS_CHUNK_SIZE SZ_64K /* bytes per pool chunk, on any page size */
+#define MCTS_MAX_WORKERS 8 /* upper bound of the mcts_workers parameter */
+#define MCTS_INDEX_SIZE (1 << 14) /* buckets of a transposition index */
+#define MCTS_MAX_CHUNKS 4096 /* chunks the pool may ever allocate */
 
+/* Context of the MCTS of one side of one game: the random stream its
+ * workers jump from and its counters, so that concurrent games share no
+ * mutable state but the node pool.
+ */
 struct mcts_info {
     struct state_array xoro_obj;
-    int nr_active_nodes;
+    int nr_active_nodes;      /* nodes the tree kept after its last move */
+    atomic64_t nr_rollouts;
+    atomic64_t nr_rl_evals;   /* leaves valued from the RL table */
+    atomic64_t search_ns;     /* time spent in search() by all workers */
+    atomic64_t nr_expanded;   /* nodes allocated by expand() */
+    atomic64_t nr_transposed; /* children found in the index instead */
+    atomic64_t nr_refused;    /* node runs refused by the budgets */
+};
+
+struct mcts_pool_stats {
+    unsigned long nr_chunks;        /* chunks owned by the pool */
+    unsigned long nr_busy_chunks;   /* chunks held by running searches */
+    unsigned long hwm_busy_chunks;  /* peak of nr_busy_chunks */
+    unsigned long hwm_search_nodes; /* largest tree built by one search */
 };
 
 // int mcts(const char *table, char player);
-int mcts(uint32_t table, char player);
+int mcts(uint32_t table, char player, int id);
+int mcts_rl(uint32_t table, char player, int id);
 void mcts_init(void);
+void mcts_release(int id);
+void mcts_exit(void);
+ssize_t mcts_stats_show(char *buf);
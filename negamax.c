@@ -1,104 +1,376 @@
-#include <linux/slab.h>
-#include <linux/sort.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#include <linux/moduleparam.h>
+#include <linux/limits.h>
 #include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
 
+#include "ai_game.h"
 #include "game.h"
 #include "negamax.h"
 #include "util.h"
 #include "zobrist.h"
 
-#define MAX_SEARCH_DEPTH 6
+#define MAX_SEARCH_DEPTH 6 /* depth searched when no budget is set */
+#define SCORE_INF 100000
+#define ASPIRATION_WINDOW 50 /* half-width of the window of a deepening step */
+#define CHECK_INTERVAL 256   /* nodes between two checks of the deadline */
 
-static int history_score_sum[N_GRIDS];
-static int history_count[N_GRIDS];
+static int negamax_workers = 1; /* clamped to NEGAMAX_MAX_WORKERS */
+module_param(negamax_workers, int, 0644);
+MODULE_PARM_DESC(negamax_workers, "Lazy SMP workers searching each move");
 
-static u64 hash_value;
+static int negamax_budget_us; /* 0: depth MAX_SEARCH_DEPTH, however long */
+module_param(negamax_budget_us, int, 0644);
+MODULE_PARM_DESC(negamax_budget_us,
+                 "Wall-clock budget of one negamax move in usecs, deepening "
+                 "as far as it allows");
 
-static int cmp_moves(const void *a, const void *b)
+/* State of one search, kept on the stack of negamax_predict() or in a
+ * helper, so that searches running at once share nothing but the
+ * transposition table, which is safe to share.
+ */
+struct negamax_ctx {
+    int history[2][N_GRIDS]; /* cutoff credit of each move of each side */
+    s8 killers[N_GRIDS][2];  /* last quiet moves failing high at each ply */
+    int ply;
+    u64 hash;            /* Zobrist key of the position being searched */
+    struct xo_eval eval; /* and its evaluation */
+    int skew;            /* breaks ties of the move order differently */
+    bool *stop;          /* set once the result of the search is not needed */
+    ktime_t deadline;    /* raising *stop once passed, 0 for none */
+    u64 nr_nodes;
+    u64 nr_searched;      /* nodes whose moves were searched */
+    u64 nr_cutoffs;       /* of them, nodes failing high */
+    u64 nr_first_cutoffs; /* of them, nodes failing high on the first move */
+};
+
+/* Lazy SMP: helpers run the same iterative deepening as the calling worker
+ * on the same position, with another move order and deepening schedule,
+ * only to fill the transposition table the caller reads.
+ */
+struct negamax_helper {
+    struct work_struct work;
+    struct negamax_ctx ctx;
+    unsigned int table;
+    char player;
+    int first_depth;
+    int max_depth;
+};
+
+/* Helpers of the search of each game */
+struct negamax_search {
+    bool stop;
+    struct negamax_helper helpers[NEGAMAX_MAX_WORKERS - 1];
+};
+
+static struct negamax_search searches[N_GAMES];
+static atomic64_t nr_nodes, nr_searched, nr_cutoffs, nr_first_cutoffs;
+
+static inline bool search_stopped(const struct negamax_ctx *ctx)
+{
+    return READ_ONCE(*ctx->stop);
+}
+
+static void check_deadline(struct negamax_ctx *ctx)
+{
+    if (ctx->deadline && !(ctx->nr_nodes % CHECK_INTERVAL) &&
+        !ktime_before(ktime_get(), ctx->deadline))
+        WRITE_ONCE(*ctx->stop, true);
+}
+
+#define HISTORY_MAX (1 << 20) /* history scores are halved past it */
+
+/* Credit @move with the beta cutoff it caused @depth plies from the leaves,
+ * and make it the first killer of the ply
+ */
+static void reward_cutoff(struct negamax_ctx *ctx,
+                          int move,
+                          char player,
+                          int depth)
+{
+    int *history = ctx->history[player == CELL_X];
+    s8 *killers = ctx->killers[ctx->ply];
+
+    history[move] += depth * depth;
+    if (history[move] > HISTORY_MAX) {
+        for (int i = 0; i < N_GRIDS; i++)
+            history[i] >>= 1;
+    }
+    if (killers[0] != move) {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+}
+
+/* Order key of @move: the table move first, then the killers of the ply,
+ * then the history score
+ */
+static int move_key(const struct negamax_ctx *ctx,
+                    int move,
+                    char player,
+                    int tt_move)
 {
-    const int *_a = (int *) a, *_b = (int *) b;
-    int score_a = 0, score_b = 0;
-
-    if (history_count[*_a])
-        score_a = history_score_sum[*_a] / history_count[*_a];
-    if (history_count[*_b])
-        score_b = history_score_sum[*_b] / history_count[*_b];
-    return score_b - score_a;
+    const s8 *killers = ctx->killers[ctx->ply];
+
+    if (move == tt_move)
+        return INT_MAX;
+    if (move == killers[0])
+        return INT_MAX - 1;
+    if (move == killers[1])
+        return INT_MAX - 2;
+    return ctx->history[player == CELL_X][move];
 }
 
-static move_t negamax(unsigned int table,
+static move_t negamax(struct negamax_ctx *ctx,
+                      unsigned int table,
                       int depth,
                       char player,
                       int alpha,
                       int beta)
 {
-    if (check_win(table) != CELL_EMPTY || depth == 0) {
-        move_t result = {get_score(table, player), -1};
+    check_deadline(ctx);
+    if (search_stopped(ctx))
+        return (move_t){0, -1};
+    ctx->nr_nodes++;
+    if (xo_eval_winner(&ctx->eval) != CELL_EMPTY || depth == 0) {
+        move_t result = {xo_eval_score(&ctx->eval, player), -1};
         return result;
     }
-    const zobrist_entry_t *entry = zobrist_get(hash_value);
-    if (entry)
-        return (move_t){.score = entry->score, .move = entry->move};
+    /* An entry searched at least as deep settles the node or narrows the
+     * window; any entry still gives the move to try first.
+     */
+    zobrist_entry_t entry;
+    int tt_move = -1;
+    if (zobrist_get(ctx->hash, &entry)) {
+        tt_move = entry.move;
+        if (entry.depth >= depth) {
+            if (entry.bound == ZOBRIST_EXACT)
+                return (move_t){.score = entry.score, .move = entry.move};
+            if (entry.bound == ZOBRIST_LOWER)
+                alpha = max(alpha, entry.score);
+            else
+                beta = min(beta, entry.score);
+            if (alpha >= beta)
+                return (move_t){.score = entry.score, .move = entry.move};
+        }
+    }
+    int alpha_orig = alpha;
 
     int score;
-    move_t best_move = {-10000, -1};
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-
-    sort(moves, n_moves, sizeof(int), cmp_moves, NULL);
+    move_t best_move = {-SCORE_INF, -1};
+    /* Moves are listed from cell skew on, so that workers break ties of the
+     * keys differently, and picked best first in place: most nodes fail
+     * high before the rest needs ordering.
+     */
+    unsigned int empty = table_empty_mask(table);
+    u8 cells[N_GRIDS];
+    int n_moves = xo_list_moves(empty, cells);
+    int first = hweight16(empty & ((1u << ctx->skew) - 1));
+    move_t moves[N_GRIDS];
+    for (int k = 0; k < n_moves; k++) {
+        int move = cells[(first + k) % n_moves];
+        moves[k].move = move;
+        moves[k].score = move_key(ctx, move, player, tt_move);
+    }
 
     for (int i = 0; i < n_moves; i++) {
-        table = VAL_SET_CELL(table, moves[i], player);
+        for (int j = i + 1; j < n_moves; j++) {
+            if (moves[j].score > moves[i].score)
+                swap(moves[i], moves[j]);
+        }
+        int move = moves[i].move;
+        table = VAL_SET_CELL(table, move, player);
 
-        hash_value ^= zobrist_table[moves[i]][player == CELL_X];
+        ctx->hash ^= zobrist_table[move][player == CELL_X];
+        xo_eval_update(&ctx->eval, move, player, 1);
+        ctx->ply++;
         if (!i)
-            score = -negamax(table, depth - 1, player ^ CELL_O ^ CELL_X, -beta,
-                             -alpha)
+            score = -negamax(ctx, table, depth - 1, player ^ CELL_O ^ CELL_X,
+                             -beta, -alpha)
                          .score;
         else {
-            score = -negamax(table, depth - 1, player ^ CELL_O ^ CELL_X,
+            score = -negamax(ctx, table, depth - 1, player ^ CELL_O ^ CELL_X,
                              -alpha - 1, -alpha)
                          .score;
             if (alpha < score && score < beta)
-                score = -negamax(table, depth - 1, player ^ CELL_O ^ CELL_X,
-                                 -beta, -score)
+                score = -negamax(ctx, table, depth - 1,
+                                 player ^ CELL_O ^ CELL_X, -beta, -score)
                              .score;
         }
-        history_count[moves[i]]++;
-        history_score_sum[moves[i]] += score;
+        ctx->ply--;
         if (score > best_move.score) {
             best_move.score = score;
-            best_move.move = moves[i];
+            best_move.move = move;
         }
-        table = VAL_SET_CELL(table, moves[i], CELL_EMPTY);
-        hash_value ^= zobrist_table[moves[i]][player == CELL_X];
+        table = VAL_SET_CELL(table, move, CELL_EMPTY);
+        ctx->hash ^= zobrist_table[move][player == CELL_X];
+        xo_eval_update(&ctx->eval, move, player, -1);
         if (score > alpha)
             alpha = score;
-        if (alpha >= beta)
+        if (alpha >= beta) {
+            reward_cutoff(ctx, move, player, depth);
+            ctx->nr_cutoffs++;
+            ctx->nr_first_cutoffs += !i;
             break;
+        }
     }
+    ctx->nr_searched++;
 
-    kfree((char *) moves);
-    zobrist_put(hash_value, best_move.score, best_move.move);
+    /* Children of an aborted search return made-up scores */
+    if (search_stopped(ctx))
+        return best_move;
+    zobrist_put(ctx->hash, best_move.score, best_move.move, depth,
+                best_move.score <= alpha_orig ? ZOBRIST_UPPER
+                : best_move.score >= beta     ? ZOBRIST_LOWER
+                                              : ZOBRIST_EXACT);
     return best_move;
 }
 
+static void flush_stats(const struct negamax_ctx *ctx)
+{
+    atomic64_add(ctx->nr_nodes, &nr_nodes);
+    atomic64_add(ctx->nr_searched, &nr_searched);
+    atomic64_add(ctx->nr_cutoffs, &nr_cutoffs);
+    atomic64_add(ctx->nr_first_cutoffs, &nr_first_cutoffs);
+}
+
+static void negamax_helper_func(struct work_struct *work)
+{
+    struct negamax_helper *helper =
+        container_of(work, struct negamax_helper, work);
+
+    for (int depth = helper->first_depth;
+         depth <= helper->max_depth && !search_stopped(&helper->ctx);
+         depth += 2)
+        negamax(&helper->ctx, helper->table, depth, helper->player,
+                -SCORE_INF, SCORE_INF);
+    flush_stats(&helper->ctx);
+}
+
 void negamax_init(void)
 {
     zobrist_init();
-    hash_value = 0;
+    for (int i = 0; i < N_GAMES; i++) {
+        for (int k = 0; k < NEGAMAX_MAX_WORKERS - 1; k++)
+            INIT_WORK(&searches[i].helpers[k].work, negamax_helper_func);
+    }
 }
 
-int negamax_predict(unsigned int table, char player)
+void negamax_exit(void)
 {
-    memset(history_score_sum, 0, sizeof(history_score_sum));
-    memset(history_count, 0, sizeof(history_count));
-    move_t result;
-    for (int depth = 2; depth <= MAX_SEARCH_DEPTH; depth += 2) {
-        result = negamax(table, depth, player, -100000, 100000);
-        zobrist_clear();
+    zobrist_exit();
+}
+
+/* Search the root @depth plies deep in a window around @guess, reopening
+ * the side the score falls out of
+ */
+static move_t search_root(struct negamax_ctx *ctx,
+                          unsigned int table,
+                          int depth,
+                          char player,
+                          int guess,
+                          bool aspire)
+{
+    int alpha = aspire ? guess - ASPIRATION_WINDOW : -SCORE_INF;
+    int beta = aspire ? guess + ASPIRATION_WINDOW : SCORE_INF;
+
+    while (1) {
+        move_t result = negamax(ctx, table, depth, player, alpha, beta);
+        if (search_stopped(ctx))
+            return result;
+        if (result.score <= alpha && alpha > -SCORE_INF)
+            alpha = -SCORE_INF;
+        else if (result.score >= beta && beta < SCORE_INF)
+            beta = SCORE_INF;
+        else
+            return result;
     }
+}
+
+/* With several workers, only the move of the calling one counts. Helpers
+ * are stopped as soon as it has one.
+ *
+ * With negamax_budget_us set, the search deepens until the board is full
+ * or the budget runs out; a step cut short by the deadline is dropped and
+ * the move of the last complete one kept. The first step always completes,
+ * and no step is started with less than half of the budget left, as it
+ * would most likely be dropped.
+ */
+int negamax_predict(unsigned int table, char player, int id)
+{
+    struct negamax_search *search = &searches[id];
+    int n_workers = clamp(READ_ONCE(negamax_workers), 1, NEGAMAX_MAX_WORKERS);
+    int budget_us = READ_ONCE(negamax_budget_us);
+    ktime_t start = ktime_get();
+    int max_depth = budget_us > 0 ? hweight16(table_empty_mask(table))
+                                  : MAX_SEARCH_DEPTH;
+    struct negamax_ctx ctx = {
+        .hash = zobrist_hash(table),
+        .stop = &search->stop,
+    };
+    move_t result = {0, -1};
+
+    /* Waits for the helpers, so never from atomic context */
+    might_sleep();
+    memset(ctx.killers, -1, sizeof(ctx.killers));
+    xo_eval_init(&ctx.eval, table);
+    /* The table keeps what shallower steps and earlier moves found */
+    zobrist_age();
+    WRITE_ONCE(search->stop, false);
+    for (int i = 1; i < n_workers; i++) {
+        struct negamax_helper *helper = &search->helpers[i - 1];
+        helper->ctx = ctx;
+        helper->ctx.skew = i;
+        helper->table = table;
+        helper->player = player;
+        /* Half of the helpers search the odd depths in between */
+        helper->first_depth = 2 + (i & 1);
+        helper->max_depth = max_depth;
+        queue_work(kxo_workqueue, &helper->work);
+    }
+
+    for (int depth = 2;; depth += 2) {
+        move_t found =
+            search_root(&ctx, table, depth, player, result.score, depth > 2);
+        if (search_stopped(&ctx))
+            break;
+        result = found;
+        if (depth >= max_depth)
+            break;
+        if (budget_us > 0) {
+            s64 elapsed = ktime_us_delta(ktime_get(), start);
+            if (elapsed * 2 > budget_us)
+                break;
+            ctx.deadline = ktime_add_us(start, budget_us);
+        }
+    }
+
+    WRITE_ONCE(search->stop, true);
+    for (int i = 1; i < n_workers; i++)
+        flush_work(&search->helpers[i - 1].work);
+    flush_stats(&ctx);
     return result.move;
 }
+
+ssize_t negamax_stats_show(char *buf)
+{
+    u64 searched = atomic64_read(&nr_searched);
+    u64 cutoffs = atomic64_read(&nr_cutoffs);
+    u64 first = atomic64_read(&nr_first_cutoffs);
+
+    return sysfs_emit(buf,
+                      "nodes %llu\n"
+                      "searched_nodes %llu\n"
+                      "cutoffs %llu\n"
+                      "first_move_cutoffs %llu\n"
+                      "cutoff_permille %llu\n"
+                      "first_move_permille %llu\n",
+                      (u64) atomic64_read(&nr_nodes), searched, cutoffs, first,
+                      searched ? div64_u64(cutoffs * 1000, searched) : 0,
+                      cutoffs ? div64_u64(first * 1000, cutoffs) : 0);
+}
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <linux/types.h>
+
+#define NEGAMAX_MAX_WORKERS 8 /* upper bound of the negamax_workers parameter */
+
 typedef struct {
     int score, move;
 } move_t;
 
 void negamax_init(void);
-int negamax_predict(unsigned int table, char player);
+void negamax_exit(void);
+int negamax_predict(unsigned int table, char player, int id);
+ssize_t negamax_stats_show(char *buf);
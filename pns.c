@@ -0,0 +1,230 @@
+#include <linux/limits.h>
+#include <linux/minmax.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+
+#include "game.h"
+#include "negamax.h"
+#include "pns.h"
+#include "util.h"
+
+#define PNS_INF U32_MAX  /* proof or disproof number of a settled node */
+#define PNS_NONE U32_MAX /* parent of the root */
+
+static int pns_max_nodes = PNS_MAX_NODES;
+module_param(pns_max_nodes, int, 0644);
+MODULE_PARM_DESC(pns_max_nodes,
+                 "Nodes in the pool of each game's proof-number search; once "
+                 "full, unproven moves are left to negamax");
+
+/* Children of a node are contiguous in the pool, so that a node only has to
+ * know where the first one lies.
+ */
+struct pns_node {
+    u32 pn, dn; /* proof and disproof numbers of the attacker winning */
+    u32 table;
+    u32 parent;
+    u32 child; /* index of the first child, 0 while a leaf */
+    u8 nr_children;
+    u8 move;   /* cell played from the parent */
+    u8 player; /* side to move */
+};
+
+/* Pool of the searches of one game, allocated at its first search */
+struct pns_tree {
+    struct pns_node *nodes;
+    unsigned int size, used;
+};
+
+static struct pns_tree trees[N_GAMES];
+
+static inline u32 pns_add(u32 a, u32 b)
+{
+    return a > PNS_INF - b ? PNS_INF : a + b;
+}
+
+/* Settle a node on its outcome @win, or guess its numbers from its
+ * mobility: an OR node is one good move away from being proven, an AND node
+ * needs all of them refuted.
+ */
+static void pns_eval(struct pns_node *node, char win, char attacker)
+{
+    if (win == attacker) {
+        node->pn = 0;
+        node->dn = PNS_INF;
+    } else if (win != CELL_EMPTY) {
+        node->pn = PNS_INF;
+        node->dn = 0;
+    } else {
+        u32 n = hweight16(table_empty_mask(node->table));
+        node->pn = node->player == attacker ? 1 : n;
+        node->dn = node->player == attacker ? n : 1;
+    }
+}
+
+static void pns_update(struct pns_tree *tree,
+                       struct pns_node *node,
+                       char attacker)
+{
+    const struct pns_node *child = &tree->nodes[node->child];
+    bool is_or = node->player == attacker;
+    u32 best = PNS_INF, sum = 0;
+
+    for (int i = 0; i < node->nr_children; i++) {
+        best = min(best, is_or ? child[i].pn : child[i].dn);
+        sum = pns_add(sum, is_or ? child[i].dn : child[i].pn);
+    }
+    node->pn = is_or ? best : sum;
+    node->dn = is_or ? sum : best;
+}
+
+/* Leaf whose expansion helps most to settle the root */
+static u32 pns_select(const struct pns_tree *tree, char attacker)
+{
+    u32 i = 0;
+
+    while (tree->nodes[i].child) {
+        const struct pns_node *node = &tree->nodes[i];
+        const struct pns_node *child = &tree->nodes[node->child];
+        int j = 0;
+
+        if (node->player == attacker) {
+            while (child[j].pn != node->pn)
+                j++;
+        } else {
+            while (child[j].dn != node->dn)
+                j++;
+        }
+        i = node->child + j;
+    }
+    return i;
+}
+
+static bool pns_expand(struct pns_tree *tree, u32 i, char attacker)
+{
+    struct pns_node *node = &tree->nodes[i];
+    unsigned int empty = table_empty_mask(node->table);
+    int n = hweight16(empty);
+
+    if (tree->used + n > tree->size)
+        return false;
+
+    node->child = tree->used;
+    node->nr_children = n;
+    tree->used += n;
+    struct pns_node *child = &tree->nodes[node->child];
+    for_each_move(move, empty) {
+        child->table = VAL_SET_CELL(node->table, move, node->player);
+        child->parent = i;
+        child->child = 0;
+        child->nr_children = 0;
+        child->move = move;
+        child->player = node->player ^ CELL_O ^ CELL_X;
+        pns_eval(child, check_win_move(child->table, move), attacker);
+        child++;
+    }
+
+    /* Ancestors left unchanged leave theirs unchanged as well */
+    while (i != PNS_NONE) {
+        node = &tree->nodes[i];
+        u32 pn = node->pn, dn = node->dn;
+        pns_update(tree, node, attacker);
+        if (node->pn == pn && node->dn == dn)
+            break;
+        i = node->parent;
+    }
+    return true;
+}
+
+/* Search whether @attacker can force a win from @table, @player to move,
+ * until the root is settled or the pool is full. Returns the root.
+ */
+static const struct pns_node *pns_prove(struct pns_tree *tree,
+                                        unsigned int table,
+                                        char player,
+                                        char attacker)
+{
+    struct pns_node *root = &tree->nodes[0];
+
+    root->table = table;
+    root->parent = PNS_NONE;
+    root->child = 0;
+    root->nr_children = 0;
+    root->player = player;
+    pns_eval(root, check_win(table), attacker);
+    tree->used = 1;
+    while (root->pn && root->dn) {
+        if (!pns_expand(tree, pns_select(tree, attacker), attacker))
+            break;
+    }
+    return root;
+}
+
+static bool pns_tree_alloc(struct pns_tree *tree)
+{
+    unsigned int size = max(READ_ONCE(pns_max_nodes), N_GRIDS + 1);
+
+    if (tree->nodes && tree->size == size)
+        return true;
+    kvfree(tree->nodes);
+    tree->nodes = kvmalloc_array(size, sizeof(struct pns_node), GFP_KERNEL);
+    tree->size = tree->nodes ? size : 0;
+    return tree->nodes;
+}
+
+/* Replace @move by one the opponent is proven not to win against, else by
+ * one it is at least not proven to win against, when the search of the
+ * opponent proved @move lost.
+ */
+static int pns_safe_move(const struct pns_tree *tree,
+                         const struct pns_node *root,
+                         int move)
+{
+    const struct pns_node *child = &tree->nodes[root->child];
+    int safe = -1, open = -1;
+
+    for (int i = 0; root->child && i < root->nr_children; i++) {
+        if (child[i].move == move && child[i].pn)
+            return move;
+        if (!child[i].dn && safe == -1)
+            safe = child[i].move;
+        if (child[i].pn && open == -1)
+            open = child[i].move;
+    }
+    if (safe != -1)
+        return safe;
+    return open == -1 ? move : open;
+}
+
+int pns_predict(unsigned int table, char player, int id)
+{
+    struct pns_tree *tree = &trees[id];
+    const struct pns_node *root, *child;
+
+    if (!pns_tree_alloc(tree))
+        return negamax_predict(table, player, id);
+
+    root = pns_prove(tree, table, player, player);
+    if (!root->pn) {
+        child = &tree->nodes[root->child];
+        while (child->pn)
+            child++;
+        return child->move;
+    }
+
+    /* Every move of a lost position is as good, take the first */
+    root = pns_prove(tree, table, player, player ^ CELL_O ^ CELL_X);
+    if (!root->pn)
+        return tree->nodes[root->child].move;
+
+    return pns_safe_move(tree, root, negamax_predict(table, player, id));
+}
+
+void pns_exit(void)
+{
+    for (int i = 0; i < N_GAMES; i++) {
+        kvfree(trees[i].nodes);
+        trees[i].nodes = NULL;
+        trees[i].size = 0;
+    }
+}
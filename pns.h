@@ -0,0 +1,8 @@
+#pragma once
+
+#include <linux/types.h>
+
+#define PNS_MAX_NODES (1 << 16) /* default of the pns_max_nodes parameter */
+
+int pns_predict(unsigned int table, char player, int id);
+void pns_exit(void);
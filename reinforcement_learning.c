@@ -1,5 +1,6 @@
 
 #include "reinforcement_learning.h"
+#include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "ai_game.h"
@@ -32,19 +33,19 @@ int table_to_hash(unsigned int table)
     return ret;
 }
 
-int play_rl(unsigned int table, char player)
+int play_rl(unsigned int table, char player, int id)
 {
     int max_act = -1;
-    fixed_point_t max_q = FIXED_MIN;
+    s32 max_q = S32_MIN;
     const rl_agent_t *agent = &rl_agents[player - 1];
     const fixed_point_t *state_value = agent->state_value;
     int candidate_count = 1;
 
     mutex_lock(&rl_locks[player - 1]);
-    for_each_empty_grid(i, table)
+    for_each_move(i, table_empty_mask(table))
     {
         table = VAL_SET_CELL(table, i, agent->player);
-        fixed_point_t new_q = state_value[table_to_hash(table)];
+        s32 new_q = state_value[table_to_hash(table)];
         if (new_q == max_q) {
             ++candidate_count;
             if (get_random_u32() % candidate_count == 0) {
@@ -61,6 +62,22 @@ int play_rl(unsigned int table, char player)
     return max_act;
 }
 
+/* Learned value of @table for @player, who has just moved there, as a win
+ * probability: the signed value of [-1, 1] in the table mapped onto [0, 1].
+ * FIXED_MAX while the agent of @player is not initialized yet. Reads are
+ * lockless, racing updates only ever yield an old or a new value.
+ */
+fixed_point_t rl_after_state_value(unsigned int table, char player)
+{
+    const fixed_point_t *state_value =
+        smp_load_acquire(&rl_agents[player - 1].state_value);
+    if (!state_value)
+        return FIXED_MAX;
+
+    s32 value = READ_ONCE(state_value[table_to_hash(table)]);
+    return (clamp(value, -RL_FIXED_1, RL_FIXED_1) + RL_FIXED_1) / 2;
+}
+
 static inline fixed_point_t step_update_state_value(int after_state_hash,
                                                     fixed_point_t reward,
                                                     fixed_point_t next,
@@ -99,12 +116,16 @@ void init_rl_agent(unsigned int state_num, char player)
 {
     rl_agent_t *agent = &rl_agents[player - 1];
     mutex_init(&rl_locks[player - 1]);
-    agent->state_value = vmalloc(sizeof(fixed_point_t) * state_num);
-    if (!(agent->state_value))
+    fixed_point_t *state_value = vmalloc(sizeof(fixed_point_t) * state_num);
+    if (!state_value) {
         pr_info("Failed to allocate memory");
+        return;
+    }
 
     for (unsigned int i = 0; i < state_num; i++) {
-        agent->state_value[i] = fixed_mul_s32(
-            INITIAL_MUTIPLIER, get_score(hash_to_table(i), player));
+        state_value[i] = fixed_mul_s32(INITIAL_MUTIPLIER,
+                                       get_score(hash_to_table(i), player));
     }
+    /* published filled for rl_after_state_value() */
+    smp_store_release(&agent->state_value, state_value);
 }
@@ -31,7 +31,9 @@ typedef struct td_agent {
 
 int table_to_hash(unsigned int table);
 
-int play_rl(unsigned int table, char player);
+int play_rl(unsigned int table, char player, int id);
+
+fixed_point_t rl_after_state_value(unsigned int table, char player);
 
 void init_rl_agent(unsigned int state_num, char player);
 
@@ -407,12 +407,15 @@ void update_table(const struct xo_table *xo_tlb)
     const char *ai_name[XO_AI_TOT] = {
         [XO_AI_MCTS] = "MCTS",
         [XO_AI_NEGAMAX] = "NEGA",
+        [XO_AI_MCTS_RL] = "MCRL",
+        [XO_AI_PNS] = "PNS",
         [XO_AI_RL] = "RL",
     };
     const char *cell_tlb[] = {" ", o_ch, x_ch};
     int id = XO_ATTR_ID(xo_tlb->attr);
     int alg = XO_ATTR_AI_ALG(xo_tlb->attr);
-    const char *o_alg = ai_name[alg & 3], *x_alg = ai_name[alg >> 2];
+    const char *o_alg = ai_name[XO_AI_ALG_O(alg)],
+               *x_alg = ai_name[XO_AI_ALG_X(alg)];
     unsigned int table = xo_tlb->table;
     int y = BOARD_BASEY + (id / UI_COLS) * (BOARD_H - 1);
 
@@ -1,42 +1,186 @@
 #pragma once
 
+#include <linux/bitops.h>
+#include <linux/string.h>
 #include <linux/types.h>
 #include "game.h"
 
-static inline int eval_line_segment_score(unsigned int table,
-                                          char player,
-                                          int i)
+/* Gather the even bits of @bits into the low 16 bits, one per cell */
+static inline unsigned int table_squeeze(unsigned int bits)
 {
-    extern u8 xo_segment_lines[WIN_PATT_LEN(BOARD_SIZE, GOAL)][GOAL];
+    bits = (bits | (bits >> 1)) & 0x33333333u;
+    bits = (bits | (bits >> 2)) & 0x0f0f0f0fu;
+    bits = (bits | (bits >> 4)) & 0x00ff00ffu;
+    bits = (bits | (bits >> 8)) & 0x0000ffffu;
+    return bits;
+}
 
-    int score = 0;
-    for (int j = 0; j < GOAL; j++) {
-        unsigned char curr = TABLE_GET_CELL(table, xo_segment_lines[i][j]);
-        if (curr == player) {
-            if (score < 0)
-                return 0;
-            if (score)
-                score *= 10;
-            else
-                score = 1;
-        } else if (curr != CELL_EMPTY) {
-            if (score > 0)
-                return 0;
-            if (score)
-                score *= 10;
-            else
-                score = -1;
+/* Bit i of the result is set when cell i of @table is empty */
+static inline unsigned int table_empty_mask(unsigned int table)
+{
+    return table_squeeze(~(table | (table >> 1)) & 0x55555555u);
+}
+
+/* Bit i of the result is set when cell i of @table holds @player */
+static inline unsigned int table_player_mask(unsigned int table, char player)
+{
+    unsigned int lo = table & 0x55555555u, hi = (table >> 1) & 0x55555555u;
+    return table_squeeze(player == CELL_X ? hi & ~lo : lo & ~hi);
+}
+
+/* Cells of O in the low 16 bits of the result and cells of X in the high
+ * 16, moving the even bits of @table down and the odd ones up.
+ */
+static inline unsigned int table_unzip(unsigned int table)
+{
+    unsigned int t;
+
+    t = (table ^ (table >> 1)) & 0x22222222u;
+    table ^= t ^ (t << 1);
+    t = (table ^ (table >> 2)) & 0x0c0c0c0cu;
+    table ^= t ^ (t << 2);
+    t = (table ^ (table >> 4)) & 0x00f000f0u;
+    table ^= t ^ (t << 4);
+    t = (table ^ (table >> 8)) & 0x0000ff00u;
+    table ^= t ^ (t << 8);
+    return table;
+}
+
+/* for_each_empty_grid() over the cells set in a 16-bit @mask, such as the
+ * one of table_empty_mask(), lowest first and without testing the others
+ */
+#define for_each_move(move, mask)                    \
+    for (unsigned int __moves = (mask), move;        \
+         __moves && ((move) = __ffs(__moves), true); \
+         __moves &= __moves - 1)
+
+/* Fill @moves with the cells set in @mask, lowest first; returns how many */
+static inline int xo_list_moves(unsigned int mask, u8 moves[N_GRIDS])
+{
+    int n = 0;
+
+    for_each_move(move, mask)
+        moves[n++] = move;
+    return n;
+}
+
+/* Index of the n-th (0-based) set bit of a 16-bit mask */
+static inline int mask_nth_cell(unsigned int mask, unsigned int n)
+{
+    int pos = 0;
+    for (int width = 8; width; width >>= 1) {
+        unsigned int cnt = hweight16(mask & ((1u << width) - 1));
+        if (n >= cnt) {
+            n -= cnt;
+            mask >>= width;
+            pos += width;
         }
     }
-    return score;
+    return pos;
 }
 
+extern u32 xo_win_patterns[WIN_PATT_LEN(BOARD_SIZE, GOAL)];
+extern u16 xo_win_cells[WIN_PATT_LEN(BOARD_SIZE, GOAL)]; /* one bit per cell */
+extern u8 xo_segment_lines[WIN_PATT_LEN(BOARD_SIZE, GOAL)][GOAL];
+extern u8 xo_cell_segments[N_GRIDS][XO_CELL_SEGMENTS];
+extern u8 xo_cell_nr_segments[N_GRIDS];
+extern int xo_segment_score[GOAL + 1][GOAL + 1]; /* by pieces of O and X */
+
+/* Heuristic value of @table for @player: the sum of xo_segment_score[] over
+ * all segments, negated for CELL_X
+ */
 static inline int get_score(const unsigned int table, char player)
 {
     int score = 0;
-    const int seg_sz = WIN_PATT_LEN(BOARD_SIZE, GOAL);
-    for (int i = 0; i < seg_sz; i++)
-        score += eval_line_segment_score(table, i, player);
+    for (int i = 0; i < WIN_PATT_LEN(BOARD_SIZE, GOAL); i++) {
+        unsigned int patt = xo_win_patterns[i];
+        score += xo_segment_score[hweight32(table & patt)]
+                                 [hweight32(table & (patt << 1))];
+    }
+    return player == CELL_X ? -score : score;
+}
+
+/* Evaluation of a position kept up to date move by move, in
+ * O(segments through the cell) per move instead of a rescan of the board
+ */
+struct xo_eval {
+    u8 pieces[WIN_PATT_LEN(BOARD_SIZE, GOAL)][2]; /* of O and X by segment */
+    u8 n_wins[2]; /* segments filled by O and by X */
+    u8 n_pieces;
+    int score; /* get_score() of the position for CELL_O */
+};
+
+/* Add (@delta 1) or take back (@delta -1) a piece of @player at @cell */
+static inline void xo_eval_update(struct xo_eval *eval,
+                                  int cell,
+                                  char player,
+                                  int delta)
+{
+    int side = player == CELL_X;
+
+    for (int k = 0; k < xo_cell_nr_segments[cell]; k++) {
+        u8 *n = eval->pieces[xo_cell_segments[cell][k]];
+        eval->score -= xo_segment_score[n[0]][n[1]];
+        eval->n_wins[side] -= n[side] == GOAL;
+        n[side] += delta;
+        eval->n_wins[side] += n[side] == GOAL;
+        eval->score += xo_segment_score[n[0]][n[1]];
+    }
+    eval->n_pieces += delta;
+}
+
+static inline void xo_eval_init(struct xo_eval *eval, unsigned int table)
+{
+    memset(eval, 0, sizeof(*eval));
+    for (int i = 0; i < N_GRIDS; i++) {
+        unsigned int cell = TABLE_GET_CELL(table, i);
+        if (cell != CELL_EMPTY)
+            xo_eval_update(eval, i, cell, 1);
+    }
+}
+
+/* Same as check_win() on the position */
+static inline char xo_eval_winner(const struct xo_eval *eval)
+{
+    if (eval->n_wins[0])
+        return CELL_O;
+    if (eval->n_wins[1])
+        return CELL_X;
+    return eval->n_pieces == N_GRIDS ? CELL_D : CELL_EMPTY;
+}
+
+/* Same as get_score() on the position */
+static inline int xo_eval_score(const struct xo_eval *eval, char player)
+{
+    return player == CELL_X ? -eval->score : eval->score;
+}
+
+/* Empty cells completing a segment for the side owning the cells of @own */
+static inline unsigned int xo_winning_cells(unsigned int own,
+                                            unsigned int empty)
+{
+    unsigned int cells = 0;
+
+    for (int i = 0; i < WIN_PATT_LEN(BOARD_SIZE, GOAL); i++) {
+        unsigned int rest = xo_win_cells[i] & ~own;
+        /* all but one cell owned: that one, if it is free */
+        cells |= rest & empty & -(unsigned int) !(rest & (rest - 1));
+    }
+    return cells;
+}
+
+/* Move @player has to make on @table, or -1 when the choice is open: a cell
+ * winning at once, else one stopping the opponent from doing so. With more
+ * threats than one to stop, the game is lost whichever is blocked.
+ */
+static inline int xo_forced_move(unsigned int table, char player)
+{
+    unsigned int empty = table_empty_mask(table);
+    unsigned int wins =
+        xo_winning_cells(table_player_mask(table, player), empty);
+    unsigned int blocks = xo_winning_cells(
+        table_player_mask(table, player ^ CELL_O ^ CELL_X), empty);
+    unsigned int forced = wins ? wins : blocks;
 
-    return score;
+    return forced ? __ffs(forced) : -1;
 }
@@ -24,16 +24,14 @@ u64 xoro_next(struct state_array *obj)
     return result;
 }
 
-void xoro_jump(struct state_array *obj)
+static void jump(struct state_array *obj, const u64 poly[2])
 {
-    static const u64 JUMP[] = {0xdf900294d8f554a5, 0x170865df4b3201fc};
-
     u64 s0 = 0;
     u64 s1 = 0;
     int i, b;
-    for (i = 0; i < sizeof(JUMP) / sizeof(*JUMP); i++) {
+    for (i = 0; i < 2; i++) {
         for (b = 0; b < 64; b++) {
-            if (JUMP[i] & (u64) (1) << b) {
+            if (poly[i] & (u64) (1) << b) {
                 s0 ^= obj->array[0];
                 s1 ^= obj->array[1];
             }
@@ -45,6 +43,24 @@ void xoro_jump(struct state_array *obj)
     obj->array[1] = s1;
 }
 
+/* Equivalent to 2^64 calls to xoro_next() */
+void xoro_jump(struct state_array *obj)
+{
+    static const u64 JUMP[] = {0xdf900294d8f554a5, 0x170865df4b3201fc};
+
+    jump(obj, JUMP);
+}
+
+/* Equivalent to 2^96 calls to xoro_next(), for 2^32 streams that can each
+ * be split by xoro_jump()
+ */
+void xoro_long_jump(struct state_array *obj)
+{
+    static const u64 LONG_JUMP[] = {0xd2a98b26625eee7b, 0xdddf9b1090aa7ac1};
+
+    jump(obj, LONG_JUMP);
+}
+
 void xoro_init(struct state_array *obj)
 {
     seed(obj, 314159265, 1618033989);
@@ -8,4 +8,5 @@ struct state_array {
 
 u64 xoro_next(struct state_array *obj);
 void xoro_jump(struct state_array *obj);
+void xoro_long_jump(struct state_array *obj);
 void xoro_init(struct state_array *obj);
@@ -1,13 +1,53 @@
+#include <linux/cache.h>
+#include <linux/ktime.h>
+#include <linux/limits.h>
+#include <linux/minmax.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 
 #include "zobrist.h"
 
 u64 zobrist_table[N_GRIDS][2];
 
-#define HASH(key) ((key) % HASH_TABLE_SIZE)
+#define ZOBRIST_BUCKETS ((1U << ZOBRIST_BITS) / ZOBRIST_WAYS)
 
-static struct hlist_head *hash_table;
-static DEFINE_SPINLOCK(zorbist_lock);
+/* Entries are stored as two words with the key XOR-ed with the data, so
+ * that readers need no lock: an entry torn by a concurrent writer fails the
+ * key check and reads as a miss. The data packs, from its low bits up, the
+ * score (32 bits), the move (8), the generation of the search that stored
+ * it (16), the depth (5) and the bound (2).
+ *
+ * Entries stay valid for as long as they are in the table, across the
+ * deepening steps and the moves of any game. The generation only ages
+ * them, so that they are replaced first.
+ */
+struct zobrist_slot {
+    u64 check; /* key ^ data */
+    u64 data;
+};
+
+struct zobrist_bucket {
+    struct zobrist_slot slots[ZOBRIST_WAYS];
+} ____cacheline_aligned;
+
+static struct zobrist_bucket *hash_table;
+static u16 generation = 1; /* 0 marks the never-written slots */
+
+static inline u64 slot_pack(int score, int move, int depth, int bound, u16 gen)
+{
+    return (u32) score | (u64) (u8) move << 32 | (u64) gen << 40 |
+           (u64) min(depth, 31) << 56 | (u64) bound << 61;
+}
+
+static inline u16 slot_gen(u64 data)
+{
+    return data >> 40;
+}
+
+static inline int slot_depth(u64 data)
+{
+    return (data >> 56) & 31;
+}
 
 /* See https://github.com/wangyi-fudan/wyhash
  */
@@ -35,58 +75,90 @@ void zobrist_init(void)
         zobrist_table[i][0] = wyhash64();
         zobrist_table[i][1] = wyhash64();
     }
-    hash_table =
-        kmalloc(sizeof(struct hlist_head) * HASH_TABLE_SIZE, GFP_KERNEL);
-    if (!hash_table) {
+    hash_table = kvcalloc(ZOBRIST_BUCKETS, sizeof(struct zobrist_bucket),
+                          GFP_KERNEL);
+    if (!hash_table)
         pr_info("kxo: Failed to allocate space for hash_table\n");
-        return;
-    }
-    for (i = 0; i < HASH_TABLE_SIZE; i++)
-        INIT_HLIST_HEAD(&hash_table[i]);
 }
 
-zobrist_entry_t *zobrist_get(u64 key)
+void zobrist_exit(void)
 {
-    unsigned long long hash_key = HASH(key);
+    kvfree(hash_table);
+    hash_table = NULL;
+}
 
-    if (hlist_empty(&hash_table[hash_key]))
-        return NULL;
+static struct zobrist_bucket *bucket_of(u64 key)
+{
+    return &hash_table[key & (ZOBRIST_BUCKETS - 1)];
+}
 
-    zobrist_entry_t *entry = NULL;
-    spin_lock_bh(&zorbist_lock);
-    hlist_for_each_entry(entry, &hash_table[hash_key], ht_list) {
-        if (entry->key == key) {
-            spin_unlock_bh(&zorbist_lock);
-            return entry;
-        }
+bool zobrist_get(u64 key, zobrist_entry_t *entry)
+{
+    if (!hash_table)
+        return false;
+
+    struct zobrist_bucket *bucket = bucket_of(key);
+    for (int i = 0; i < ZOBRIST_WAYS; i++) {
+        u64 data = READ_ONCE(bucket->slots[i].data);
+        if ((READ_ONCE(bucket->slots[i].check) ^ data) != key ||
+            !slot_gen(data))
+            continue;
+        entry->score = (s32) data;
+        entry->move = (s8) (data >> 32);
+        entry->depth = slot_depth(data);
+        entry->bound = (data >> 61) & 3;
+        return true;
     }
-    spin_unlock_bh(&zorbist_lock);
-    return NULL;
+    return false;
 }
 
-void zobrist_put(u64 key, int score, int move)
+/* Rank of a slot as a victim, lowest first: slots of older searches, then
+ * the shallowest ones of the current search
+ */
+static inline int slot_worth(u64 data, u16 gen)
 {
-    unsigned long long hash_key = HASH(key);
-    zobrist_entry_t *new_entry = kmalloc(sizeof(zobrist_entry_t), GFP_KERNEL);
-    new_entry->key = key;
-    new_entry->move = move;
-    new_entry->score = score;
-    spin_lock_bh(&zorbist_lock);
-    hlist_add_head(&new_entry->ht_list, &hash_table[hash_key]);
-    spin_unlock_bh(&zorbist_lock);
+    return (slot_gen(data) == gen) << 5 | slot_depth(data);
 }
 
-void zobrist_clear(void)
+/* Store into the slot already holding @key, unless it was searched deeper
+ * by the current search, else over the least worth keeping in the bucket.
+ * Racing writers may lose an entry, never corrupt one.
+ */
+void zobrist_put(u64 key, int score, int move, int depth, int bound)
 {
-    spin_lock_bh(&zorbist_lock);
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        while (!hlist_empty(&hash_table[i])) {
-            zobrist_entry_t *entry =
-                hlist_entry(hash_table[i].first, zobrist_entry_t, ht_list);
-            hlist_del(&entry->ht_list);
-            kfree(entry);
+    if (!hash_table)
+        return;
+
+    struct zobrist_bucket *bucket = bucket_of(key);
+    u16 gen = READ_ONCE(generation);
+    struct zobrist_slot *victim = NULL;
+    int victim_worth = INT_MAX;
+    for (int i = 0; i < ZOBRIST_WAYS; i++) {
+        struct zobrist_slot *slot = &bucket->slots[i];
+        u64 data = READ_ONCE(slot->data);
+        if ((READ_ONCE(slot->check) ^ data) == key && slot_gen(data)) {
+            if (slot_gen(data) == gen && slot_depth(data) > depth)
+                return;
+            victim = slot;
+            break;
+        }
+        if (slot_worth(data, gen) < victim_worth) {
+            victim = slot;
+            victim_worth = slot_worth(data, gen);
         }
-        INIT_HLIST_HEAD(&hash_table[i]);
     }
-    spin_unlock_bh(&zorbist_lock);
+
+    u64 data = slot_pack(score, move, depth, bound, gen);
+    WRITE_ONCE(victim->data, data);
+    WRITE_ONCE(victim->check, key ^ data);
+}
+
+/* Start a new search: the entries stored so far stay valid but are
+ * replaced before the ones the new search stores.
+ */
+void zobrist_age(void)
+{
+    u16 gen = READ_ONCE(generation) + 1;
+
+    WRITE_ONCE(generation, gen ? gen : 1);
 }
@@ -1,21 +1,42 @@
 #pragma once
 
-#include <linux/list.h>
+#include <linux/types.h>
 
 #include "game.h"
 
-#define HASH_TABLE_SIZE (100003)
+#define ZOBRIST_BITS 16 /* log2 of the entries of the transposition table */
+#define ZOBRIST_WAYS 4  /* entries per bucket, one cache line */
 
 extern u64 zobrist_table[N_GRIDS][2];
 
+/* How the score of an entry bounds the value of its position */
+enum {
+    ZOBRIST_EXACT,
+    ZOBRIST_LOWER, /* the search failed high, the value is at least score */
+    ZOBRIST_UPPER, /* the search failed low, the value is at most score */
+};
+
 typedef struct {
-    u64 key;
     int score;
     int move;
-    struct hlist_node ht_list;
+    int depth; /* plies searched below the position */
+    int bound;
 } zobrist_entry_t;
 
+/* Key of the position @table, from scratch */
+static inline u64 zobrist_hash(unsigned int table)
+{
+    u64 hash = 0;
+    for (int i = 0; i < N_GRIDS; i++) {
+        unsigned int cell = TABLE_GET_CELL(table, i);
+        if (cell != CELL_EMPTY)
+            hash ^= zobrist_table[i][cell == CELL_X];
+    }
+    return hash;
+}
+
 void zobrist_init(void);
-zobrist_entry_t *zobrist_get(u64 key);
-void zobrist_put(u64 key, int score, int move);
-void zobrist_clear(void);
+void zobrist_exit(void);
+bool zobrist_get(u64 key, zobrist_entry_t *entry);
+void zobrist_put(u64 key, int score, int move, int depth, int bound);
+void zobrist_age(void);